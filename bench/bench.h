@@ -0,0 +1,36 @@
+#pragma once
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+#include <time.h>
+
+/* Runs timed by BENCH_TIME(), the fastest one counts. */
+#define BENCH_ROUNDS 5
+
+static inline double bench_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Run "expr" BENCH_ROUNDS times, return the fastest run in milliseconds. */
+#define BENCH_TIME(expr) ({						\
+	double best_ = 1e30, t_;					\
+	int r_;								\
+	for (r_ = 0; r_ < BENCH_ROUNDS; r_++) {				\
+		t_ = bench_now_ms();					\
+		expr;							\
+		t_ = bench_now_ms() - t_;				\
+		if (t_ < best_)						\
+			best_ = t_;					\
+	}								\
+	best_;								\
+})
@@ -0,0 +1,147 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Check the newline kernels against each other, then time them.
+ *
+ * The kernels are static, so newline.c is included rather than linked.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../newline.c"
+#include "bench.h"
+
+#define CHECK_INPUTS 200000
+#define CHECK_MAX_LEN 300
+#define BENCH_SIZE (64 * 1024 * 1024)
+/* One byte in this many is a newline, about the length of a line of code. */
+#define BENCH_LINE 70
+
+struct kernels {
+	const char *name;
+	int (*count)(const char *, int);
+	const char *(*find)(const char *, int, int *);
+	const char *(*rfind)(const char *, int, int *);
+};
+
+static struct kernels kernels[] = {
+	{"scalar", count_scalar, find_scalar, rfind_scalar},
+#ifdef NEWLINE_X86
+	{"sse2", count_sse2, find_sse2, rfind_sse2},
+	{"avx2", count_avx2, find_avx2, rfind_avx2},
+#endif
+};
+
+static int n_kernels(void)
+{
+	int n = sizeof(kernels) / sizeof(kernels[0]);
+
+#ifdef NEWLINE_X86
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("popcnt"))
+		n--;
+#endif
+	return n;
+}
+
+/* Compare every kernel with the scalar one on random text at every
+   alignment, for every "nth" up to one past the number of newlines. */
+static bool check(void)
+{
+	static char mem[CHECK_MAX_LEN + 64];
+	int i, k, nth, n_k = n_kernels();
+
+	srand(1);
+	for (i = 0; i < CHECK_INPUTS; i++) {
+		int len = rand() % CHECK_MAX_LEN;
+		int density = 1 + rand() % 64;
+		char *s = mem + i % 32;
+		int count, j;
+
+		for (j = 0; j < len; j++)
+			s[j] = rand() % density ? 'a' + rand() % 26 : '\n';
+		count = count_scalar(s, len);
+		for (k = 1; k < n_k; k++) {
+			if (kernels[k].count(s, len) != count) {
+				printf("%s: count differs on input %d\n", kernels[k].name, i);
+				return false;
+			}
+			/* "*nth" only matters when the newline isn't found. */
+			for (nth = 1; nth <= count + 1; nth++) {
+				int a = nth, b = nth;
+				const char *p;
+
+				p = kernels[k].find(s, len, &a);
+				if (p != find_scalar(s, len, &b) || !p && a != b) {
+					printf("%s: find differs on input %d\n", kernels[k].name, i);
+					return false;
+				}
+				a = b = nth;
+				p = kernels[k].rfind(s, len, &a);
+				if (p != rfind_scalar(s, len, &b) || !p && a != b) {
+					printf("%s: rfind differs on input %d\n", kernels[k].name, i);
+					return false;
+				}
+			}
+		}
+	}
+	printf("%d kernels agree on %d random inputs\n", n_k, CHECK_INPUTS);
+
+	return true;
+}
+
+static int count_memchr(const char *s, int n)
+{
+	const char *end = s + n;
+	int nl = 0;
+
+	while ((s = memchr(s, '\n', end - s))) {
+		nl++;
+		s++;
+	}
+
+	return nl;
+}
+
+static void bench(void)
+{
+	char *s = malloc(BENCH_SIZE);
+	int i, k, total, nth, n_k = n_kernels();
+	volatile int sink;
+
+	if (!s)
+		abort();
+	srand(2);
+	for (i = 0; i < BENCH_SIZE; i++)
+		s[i] = rand() % BENCH_LINE ? 'a' + i % 26 : '\n';
+	total = count_scalar(s, BENCH_SIZE);
+
+	printf("%d MB, %d newlines, fastest of %d runs:\n", BENCH_SIZE >> 20, total, BENCH_ROUNDS);
+	printf("  memchr  count %4.0f ms\n", BENCH_TIME(sink = count_memchr(s, BENCH_SIZE)));
+	for (k = 0; k < n_k; k++) {
+		printf("  %-6s  count %4.0f ms", kernels[k].name,
+		       BENCH_TIME(sink = kernels[k].count(s, BENCH_SIZE)));
+		printf("  find %4.0f ms", BENCH_TIME((nth = total, sink = !!kernels[k].find(s, BENCH_SIZE, &nth))));
+		printf("  rfind %4.0f ms\n", BENCH_TIME((nth = total, sink = !!kernels[k].rfind(s, BENCH_SIZE, &nth))));
+	}
+	(void)sink;
+	free(s);
+}
+
+int main(void)
+{
+	if (!check())
+		return 1;
+	bench();
+
+	return 0;
+}
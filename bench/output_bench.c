@@ -0,0 +1,123 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Count the bytes the editor writes to the terminal with each output
+ * backend, for the same keys. The editor runs in a pseudo-terminal, and
+ * the keys are sent one at a time, waiting for the screen to settle.
+ *
+ * Usage: output_bench [path to mini]
+ */
+
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BENCH_ROWS 30
+#define BENCH_COLS 100
+#define BENCH_LINES 2000
+/* The output is over once nothing came for this long. */
+#define QUIET_MS 150
+
+struct script {
+	const char *name;
+	const char *keys[32];
+};
+
+/* Keys of the dvorak layout the editor uses by default. */
+static const struct script scripts[] = {
+	{"moving", {"t", "t", "t", "n", "n", "N", "H", "c", "T", "T", "C", "d", NULL}},
+	{"typing", {"t", "\r", "a", "b", "c", " ", "d", "e", "f", "\x7f", "\x7f", "\x1b", NULL}},
+	{"paging", {"T", "T", "T", "T", "T", "C", "C", "C", "C", "C", NULL}},
+};
+
+/* Read whatever comes from "fd" until it has been quiet for QUIET_MS.
+   Return the number of bytes. */
+static long drain(int fd)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	char buf[65536];
+	long total = 0;
+	ssize_t n;
+
+	while (poll(&pfd, 1, QUIET_MS) > 0) {
+		n = read(fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+		total += n;
+	}
+
+	return total;
+}
+
+/* Run "keys" through the editor with the "output" backend, return the
+   number of bytes written for them, after the first screen. */
+static long run(const char *mini, const char *output, const char *path, const char *const *keys)
+{
+	struct winsize ws = {.ws_row = BENCH_ROWS, .ws_col = BENCH_COLS};
+	long total = 0;
+	pid_t pid;
+	int fd, i;
+
+	pid = forkpty(&fd, NULL, NULL, &ws);
+	if (pid < 0) {
+		perror("forkpty");
+		exit(1);
+	}
+	if (pid == 0) {
+		setenv("TERM", "xterm-256color", 1);
+		execl(mini, mini, "-o", output, path, (char *)NULL);
+		_exit(127);
+	}
+	drain(fd);
+	for (i = 0; keys[i]; i++) {
+		if (write(fd, keys[i], strlen(keys[i])) < 0)
+			break;
+		total += drain(fd);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	close(fd);
+
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mini = argc > 1 ? argv[1] : "./mini";
+	char path[] = "/tmp/output_bench.XXXXXX";
+	FILE *fp;
+	int fd, i, n;
+
+	fd = mkstemp(path);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		perror(path);
+		return 1;
+	}
+	for (i = 0; i < BENCH_LINES; i++)
+		fprintf(fp, "%*sif (line_%d > %d)\treturn \"%s\";\n", i % 4 * 8, "", i, i * 7,
+			i % 3 ? "short" : "a somewhat longer string on this line");
+	fclose(fp);
+
+	printf("Bytes written to a %dx%d terminal, curses -> vt:\n", BENCH_COLS, BENCH_ROWS);
+	for (i = 0; i < sizeof(scripts) / sizeof(scripts[0]); i++) {
+		for (n = 0; scripts[i].keys[n]; n++)
+			;
+		printf("  %-7s %2d keys  %6ld -> ", scripts[i].name, n,
+		       run(mini, "curses", path, scripts[i].keys));
+		printf("%6ld\n", run(mini, "vt", path, scripts[i].keys));
+	}
+	unlink(path);
+
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Time saving a large file after one edit, in every storage: writing it in
+ * place through stdio, as the editor used to, against buffer_save(), which
+ * writes a temporary file, syncs it and renames it over the target. Both
+ * files are checked against the text that was expected.
+ *
+ * Usage: save_bench [size in MB]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../mini.h"
+#include "bench.h"
+
+/* Buffer positions are ints, so files can't get much larger than this. */
+#define BENCH_SIZE_MB 256
+
+static const char *storage_names[] = {"gap", "piece", "rope"};
+
+static void fill_text(char *s, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int r = rand() % 64;
+
+		s[i] = r < 52 ? 'a' + r % 26 : r < 62 ? ' ' : '\n';
+	}
+}
+
+static int write_file(const char *path, const char *text, int n)
+{
+	FILE *fp = fopen(path, "w");
+	int rc = 0;
+
+	if (!fp)
+		return -1;
+	if (fwrite(text, 1, n, fp) != n)
+		rc = -1;
+	if (fclose(fp) != 0)
+		rc = -1;
+
+	return rc;
+}
+
+/* The old way: truncate the file and write the spans through stdio. */
+static int save_in_place(struct buffer *buf, const char *path)
+{
+	struct span sp;
+	FILE *fp;
+	int pos = 0;
+
+	fp = fopen(path, "w+");
+	if (!fp)
+		return -1;
+	while (buffer_span_forward(buf, pos, buf->used, &sp)) {
+		if (fwrite(sp.data, 1, sp.len, fp) != sp.len)
+			break;
+		pos = sp.pos + sp.len;
+	}
+	fclose(fp);
+
+	return pos == buf->used ? 0 : -1;
+}
+
+static bool same_file(const char *path, const char *text, int n)
+{
+	char *s = malloc(n + 1);
+	FILE *fp = fopen(path, "r");
+	bool same = false;
+
+	if (!s)
+		oom();
+	if (fp) {
+		same = fread(s, 1, n + 1, fp) == n && memcmp(s, text, n) == 0;
+		fclose(fp);
+	}
+	free(s);
+
+	return same;
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/save_bench.XXXXXX";
+	char *text, *expected, *orig, *old, *new;
+	int n, storage, rc = 0;
+
+	n = (argc > 1 ? atoi(argv[1]) : BENCH_SIZE_MB) * 1024 * 1024;
+	text = malloc(n);
+	expected = malloc(n + 1);
+	if (!text || !expected)
+		oom();
+	srand(1);
+	fill_text(text, n);
+	/* The edit is a character in the middle of the text. */
+	memcpy(expected, text, n / 2);
+	expected[n / 2] = '#';
+	memcpy(expected + n / 2 + 1, text + n / 2, n - n / 2);
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	if (asprintf(&orig, "%s/orig", dir) < 0 || asprintf(&old, "%s/old", dir) < 0 ||
+	    asprintf(&new, "%s/new", dir) < 0)
+		oom();
+	if (write_file(orig, text, n) < 0) {
+		perror(orig);
+		return 1;
+	}
+
+	printf("Saving %d MB after one edit, in place -> buffer_save():\n", n >> 20);
+	for (storage = STORAGE_GAP; storage <= STORAGE_ROPE; storage++) {
+		struct buffer *buf = buffer_new();
+		double ms;
+
+		buf->undo.max = 0;
+		if (buffer_load(buf, orig, storage) < 0) {
+			perror(orig);
+			return 1;
+		}
+		buffer_set_cursor(buf, n / 2);
+		buffer_insert_char(buf, '#');
+
+		printf("  %-5s  %6.0f -> ", storage_names[storage],
+		       BENCH_TIME(rc |= save_in_place(buf, old)));
+		ms = BENCH_TIME(rc |= buffer_save(buf, new));
+		printf("%6.0f ms\n", ms);
+		if (rc < 0 || !same_file(old, expected, n + 1) || !same_file(new, expected, n + 1)) {
+			printf("  %s: the saved file differs from the text\n", storage_names[storage]);
+			rc = -1;
+		}
+		buffer_free(buf);
+		unlink(old);
+		unlink(new);
+	}
+
+	unlink(orig);
+	rmdir(dir);
+	free(orig);
+	free(old);
+	free(new);
+	free(expected);
+	free(text);
+
+	return rc < 0;
+}
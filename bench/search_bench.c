@@ -0,0 +1,116 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Time failing substring searches by needle length: the search inside the
+ * buffer's spans against copying the text out and calling strstr(), as the
+ * editor used to, and against memmem() on text that fits in the cache.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mini.h"
+#include "../search.h"
+#include "bench.h"
+
+#define BENCH_SIZE (220 * 1024 * 1024)
+#define BENCH_CACHED (2 * 1024 * 1024)
+
+static const int needle_lens[] = {3, 12, 61, 96};
+
+/* Fill "s" with lowercase words and newlines, which are all the needles
+   are made of except for their last byte, so they are never found. */
+static void fill_text(char *s, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int r = rand() % 64;
+
+		s[i] = r < 52 ? 'a' + r % 26 : r < 62 ? ' ' : '\n';
+	}
+}
+
+static void make_needle(char *needle, int len, const char *text)
+{
+	memcpy(needle, text, len - 1);
+	needle[len - 1] = '#';
+	needle[len] = '\0';
+}
+
+static struct buffer *make_buffer(const char *text, int n)
+{
+	struct buffer *buf = buffer_new();
+
+	buf->undo.max = 0;
+	buffer_insert_string(buf, text, n);
+
+	return buf;
+}
+
+/* The old way: copy the text out and let strstr() search it. */
+static int copy_strstr(struct buffer *buf, const char *needle)
+{
+	char *text = buffer_get_content(buf), *s;
+	int p;
+
+	s = strstr(text, needle);
+	p = s ? s - text : -1;
+	free(text);
+
+	return p;
+}
+
+int main(void)
+{
+	struct search_pattern pat;
+	struct buffer *buf;
+	char *text, needle[128];
+	volatile int sink;
+	double ms;
+	int i, k;
+
+	text = malloc(BENCH_SIZE);
+	if (!text)
+		oom();
+	srand(1);
+	fill_text(text, BENCH_SIZE);
+
+	buf = make_buffer(text, BENCH_SIZE);
+	printf("Failing search over %d MB, copy + strstr() -> search_next():\n", BENCH_SIZE >> 20);
+	for (i = 0; i < sizeof(needle_lens) / sizeof(needle_lens[0]); i++) {
+		make_needle(needle, needle_lens[i], text + 1000);
+		search_init(&pat, needle, needle_lens[i]);
+		printf("  %2d bytes  %4.0f -> ", needle_lens[i],
+		       BENCH_TIME(sink = copy_strstr(buf, needle)));
+		printf("%4.0f ms\n", BENCH_TIME(sink = search_next(buf, &pat, 0)));
+	}
+	buffer_free(buf);
+
+	/* Repeat the search enough times that the text stays in the cache. */
+	buf = make_buffer(text, BENCH_CACHED);
+	printf("Failing search over %d MB in the cache, search_next() and memmem():\n",
+	       BENCH_CACHED >> 20);
+	for (i = 0; i < sizeof(needle_lens) / sizeof(needle_lens[0]); i++) {
+		make_needle(needle, needle_lens[i], text + 1000);
+		search_init(&pat, needle, needle_lens[i]);
+		ms = BENCH_TIME(for (k = 0; k < 100; k++) sink = search_next(buf, &pat, 0));
+		printf("  %2d bytes  %5.1f GB/s", needle_lens[i], 100.0 * BENCH_CACHED / ms / 1e6);
+		ms = BENCH_TIME(for (k = 0; k < 100; k++)
+					sink = !!memmem(text, BENCH_CACHED, needle, needle_lens[i]));
+		printf("  %5.1f GB/s\n", 100.0 * BENCH_CACHED / ms / 1e6);
+	}
+	buffer_free(buf);
+	(void)sink;
+	free(text);
+
+	return 0;
+}
@@ -40,10 +40,15 @@ enum color_pair_id {
 	CP_NORMAL_TEXT,
 	CP_ERROR,
 	CP_HIGHLIGHT_SELECTION,
+	CP_HIGHLIGHT_SEARCH,
 	CP_MODE_COMMAND,
 	CP_MODE_EDITING,
 	CP_MODE_SELECTION,
 };
+/* How text is shown: a color pair, possibly bold. */
+#define ATTR_BOLD 0x100
+#define ATTR_PAIR(attr) ((attr) & 0xff)
+
 struct color_pair {
 	int id;
 	int fg;
@@ -24,19 +24,36 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <curses.h>
 #include "mini.h"
 #include "color.h"
+#include "newline.h"
+#include "parallel.h"
+#include "piece.h"
+#include "regex.h"
+#include "rope.h"
+#include "search.h"
 #include "utf8.h"
+#include "vt.h"
 
 static struct editor editor = {};
+/* The window keys are read through. With "-o vt", curses never draws in it. */
+static WINDOW *input;
 struct keybinding dvorak_keybindings[] = {
 	{'n', M_COMMAND|M_SELECTION, command_move_forward_char},
 	{'h', M_COMMAND|M_SELECTION, command_move_backward_char},
@@ -75,6 +92,8 @@ struct keybinding dvorak_keybindings[] = {
 	{']', M_COMMAND|M_SELECTION, command_next_buffer},
 	{'[', M_COMMAND|M_SELECTION, command_previous_buffer},
 	{CTRL('l'), M_ALL_BASIC, command_recenter},
+	{CTRL('z'), M_ALL_BASIC, command_undo},
+	{CTRL('y'), M_ALL_BASIC, command_redo},
 	/* Searching. */
 	{'s', M_COMMAND, command_search_forward},
 	{'S', M_COMMAND, command_search_backward},
@@ -82,12 +101,16 @@ struct keybinding dvorak_keybindings[] = {
 	{'W', M_COMMAND, command_goto_previous_search},
 	/* Self insertion. */
 	{KEY_ENTER, M_EDITING, command_insert_newline},
+	{KEY_PASTE, M_ALL_BASIC, command_insert_paste},
+	{KEY_PASTE_END, M_ALL, command_ignore},
 	{KEY_ANY, M_EDITING, command_insert_self},
 	/* Minibuffer. */
 	{KEY_ENTER, M_MINIBUFFER, command_minibuffer_do_action},
 	{KEY_BACKSPACE, M_MINIBUFFER, command_minibuffer_delete_backward_char},
 	{CTRL('x'), M_MINIBUFFER, command_minibuffer_clear},
+	{CTRL('r'), M_MINIBUFFER, command_search_toggle_regex},
 	{KEY_ESC, M_MINIBUFFER, command_minibuffer_cancel},
+	{KEY_PASTE, M_MINIBUFFER, command_minibuffer_insert_paste},
 	{KEY_ANY, M_MINIBUFFER, command_minibuffer_insert_self_and_update},
 	{-1, -1, NULL}
 };
@@ -130,6 +153,8 @@ struct keybinding qwerty_keybindings[] = {
 	{']', M_COMMAND|M_SELECTION, command_next_buffer},
 	{'[', M_COMMAND|M_SELECTION, command_previous_buffer},
 	{CTRL('l'), M_ALL_BASIC, command_recenter},
+	{CTRL('z'), M_ALL_BASIC, command_undo},
+	{CTRL('y'), M_ALL_BASIC, command_redo},
 	/* Searching. */
 	{';', M_COMMAND, command_search_forward},
 	{':', M_COMMAND, command_search_backward},
@@ -137,12 +162,16 @@ struct keybinding qwerty_keybindings[] = {
 	{'<', M_COMMAND, command_goto_previous_search},
 	/* Self insertion. */
 	{KEY_ENTER, M_EDITING, command_insert_newline},
+	{KEY_PASTE, M_ALL_BASIC, command_insert_paste},
+	{KEY_PASTE_END, M_ALL, command_ignore},
 	{KEY_ANY, M_EDITING, command_insert_self},
 	/* Minibuffer. */
 	{KEY_ENTER, M_MINIBUFFER, command_minibuffer_do_action},
 	{KEY_BACKSPACE, M_MINIBUFFER, command_minibuffer_delete_backward_char},
 	{CTRL('x'), M_MINIBUFFER, command_minibuffer_clear},
+	{CTRL('r'), M_MINIBUFFER, command_search_toggle_regex},
 	{KEY_ESC, M_MINIBUFFER, command_minibuffer_cancel},
+	{KEY_PASTE, M_MINIBUFFER, command_minibuffer_insert_paste},
 	{KEY_ANY, M_MINIBUFFER, command_minibuffer_insert_self_and_update},
 	{-1, -1, NULL}
 };
@@ -171,12 +200,552 @@ struct color_pair color_pairs[] = {
 	{CP_NORMAL_TEXT,         COLOR_ID_BASE00, -1},
 	{CP_ERROR,               COLOR_ID_RED,    -1},
 	{CP_HIGHLIGHT_SELECTION, COLOR_ID_BASE00,  COLOR_ID_BASE2},
+	{CP_HIGHLIGHT_SEARCH,    COLOR_ID_BASE3,   COLOR_ID_YELLOW},
 	{CP_MODE_COMMAND,        COLOR_ID_BLUE,   -1},
 	{CP_MODE_EDITING,        COLOR_ID_GREEN,  -1},
 	{CP_MODE_SELECTION,      COLOR_ID_ORANGE, -1},
 	{-1, -1, -1}
 };
 
+static int buffer_span_at(struct buffer *buf, int pos, const char **data);
+static void buffer_cursor_column_update(struct buffer *buf);
+
+static void line_index_init(struct line_index *li)
+{
+	li->size = LINE_INDEX_ALLOC_CHUNK;
+	li->starts = calloc(li->size, sizeof(int));
+	if (!li->starts)
+		oom();
+	/* The first line always begins at 0. */
+	li->gap_start = 1;
+	li->gap_end = li->size;
+	li->indexed = 0;
+}
+
+static void line_index_reset(struct line_index *li)
+{
+	li->gap_start = 1;
+	li->gap_end = li->size;
+	li->indexed = 0;
+}
+
+static int line_index_count(struct line_index *li)
+{
+	return li->gap_start + li->size - li->gap_end;
+}
+
+static int line_index_get(struct line_index *li, int line)
+{
+	if (line < li->gap_start)
+		return li->starts[line];
+	return li->indexed - li->starts[line + li->gap_end - li->gap_start];
+}
+
+/* Move the gap so that exactly "at" entries precede it. */
+static void line_index_move_gap(struct line_index *li, int at)
+{
+	while (li->gap_start > at) {
+		li->gap_start--;
+		li->gap_end--;
+		li->starts[li->gap_end] = li->indexed - li->starts[li->gap_start];
+	}
+	while (li->gap_start < at) {
+		li->starts[li->gap_start] = li->indexed - li->starts[li->gap_end];
+		li->gap_start++;
+		li->gap_end++;
+	}
+}
+
+static void line_index_expand(struct line_index *li)
+{
+	int size = li->size * 2;
+	int tail = li->size - li->gap_end;
+
+	li->starts = realloc(li->starts, size * sizeof(int));
+	if (!li->starts)
+		oom();
+	memmove(li->starts + size - tail, li->starts + li->gap_end, tail * sizeof(int));
+	li->gap_end = size - tail;
+	li->size = size;
+}
+
+static void line_index_add(struct line_index *li, int start)
+{
+	if (li->gap_start == li->gap_end)
+		line_index_expand(li);
+	li->starts[li->gap_start++] = start;
+}
+
+/* Index the text up to at least position "pos".
+ * Scanning is done in chunks, so walking down a freshly loaded file doesn't
+ * rescan a little bit at a time.
+ */
+static void line_index_extend(struct buffer *buf, int pos)
+{
+	struct line_index *li = &buf->lines;
+
+	if (pos <= li->indexed || li->indexed >= buf->used)
+		return;
+
+	pos = min(max(pos, li->indexed + LINE_INDEX_SCAN_CHUNK), buf->used);
+	line_index_move_gap(li, line_index_count(li));
+	while (li->indexed < pos) {
+		const char *data, *p, *nl;
+		int len;
+
+		len = min(buffer_span_at(buf, li->indexed, &data), pos - li->indexed);
+		p = data;
+		while ((nl = memchr(p, '\n', data + len - p))) {
+			line_index_add(li, li->indexed + (nl - data) + 1);
+			p = nl + 1;
+		}
+		li->indexed += len;
+	}
+}
+
+/* Record lines started by inserting "len" bytes of "str" at "pos".
+ * Must be called before the text is modified.
+ */
+static void line_index_insert(struct buffer *buf, int pos, const char *str, int len)
+{
+	struct line_index *li = &buf->lines;
+	int i;
+
+	/* A rope keeps count of its lines itself. */
+	if (buf->storage == STORAGE_ROPE)
+		return;
+
+	line_index_move_gap(li, buffer_line_at(buf, pos) + 1);
+	for (i = 0; i < len; i++) {
+		if (str[i] == '\n')
+			line_index_add(li, pos + i + 1);
+	}
+	li->indexed += len;
+}
+
+/* Forget lines ended by the "n" bytes deleted at "pos".
+ * Must be called before the text is modified.
+ */
+static void line_index_delete(struct buffer *buf, int pos, int n)
+{
+	struct line_index *li = &buf->lines;
+
+	if (buf->storage == STORAGE_ROPE)
+		return;
+
+	line_index_extend(buf, pos + n);
+	line_index_move_gap(li, buffer_line_at(buf, pos) + 1);
+	while (li->gap_end < li->size
+	       && li->indexed - li->starts[li->gap_end] <= pos + n)
+		li->gap_end++;
+	li->indexed -= n;
+}
+
+static void column_cache_reset(struct column_cache *cc)
+{
+	cc->line_start = -1;
+	cc->line_end = -1;
+	cc->len = 0;
+}
+
+static void column_cache_reset_all(struct buffer *buf)
+{
+	int i;
+
+	for (i = 0; i < COLUMN_CACHE_LINES; i++)
+		column_cache_reset(&buf->columns[i]);
+}
+
+static void column_cache_free(struct buffer *buf)
+{
+	int i;
+
+	for (i = 0; i < COLUMN_CACHE_LINES; i++) {
+		free(buf->columns[i].cols);
+		buf->columns[i].cols = NULL;
+		buf->columns[i].size = 0;
+	}
+	column_cache_reset_all(buf);
+}
+
+static void wrap_map_reset(struct wrap_map *wm)
+{
+	wm->first = 0;
+	wm->len = 0;
+}
+
+static void wrap_map_free(struct wrap_map *wm)
+{
+	free(wm->rows);
+	wm->rows = NULL;
+	wrap_map_reset(wm);
+}
+
+static long long clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Matches of a search pattern in a buffer, counted in the background.
+ * Their positions are kept in a gap array like line beginnings are, so that
+ * an edit only has to look for matches around the edited text. A literal
+ * match depends on the "len" bytes it covers and nothing else. A regex match
+ * may depend on any amount of text, so regex counts are counted anew after
+ * an edit, as are counts with too many matches to keep.
+ */
+struct match_count {
+	char *str;
+	int len;
+	struct search_pattern pat;
+	/* The compiled "str" for a regex count, NULL for a literal one. */
+	struct regex *re;
+	struct line_index starts;
+	int total;
+	/* There are more than MATCH_COUNT_MAX matches, only "total" is known. */
+	bool overflow;
+	bool complete;
+	/* Counting in the background, through "view". */
+	pthread_t thread;
+	bool started;
+	long long due;
+	long long shown;
+	struct buffer *view;
+	int cancel;
+	int done;
+	int found;
+	int scanned;
+};
+
+/* Record a match at "pos", unless there are too many to keep. */
+static void match_count_add(struct match_count *mc, int pos)
+{
+	mc->total++;
+	if (line_index_count(&mc->starts) >= MATCH_COUNT_MAX)
+		mc->overflow = true;
+	if (!mc->overflow)
+		line_index_add(&mc->starts, pos);
+}
+
+/* Find the matches that begin at "from" or later, but before "limit". */
+static void match_count_range(struct match_count *mc, struct buffer *buf, int from, int limit)
+{
+	int p, s, e;
+
+	for (p = from; p < limit; p = s + 1) {
+		if (mc->re)
+			s = regex_search_range(mc->re, buf, p, limit, &e);
+		else
+			s = search_range(buf, &mc->pat, p, limit + mc->len - 1);
+		if (s < 0)
+			break;
+		match_count_add(mc, s);
+	}
+}
+
+static void *match_count_run(void *data)
+{
+	struct match_count *mc = data;
+	struct buffer *view = mc->view;
+	int beg, end;
+
+	for (beg = 0; beg < view->used; beg = end) {
+		end = min(beg + MATCH_COUNT_CHUNK, view->used);
+		match_count_range(mc, view, beg, end);
+		if (__atomic_load_n(&mc->cancel, __ATOMIC_RELAXED))
+			break;
+		__atomic_store_n(&mc->found, mc->total, __ATOMIC_RELAXED);
+		__atomic_store_n(&mc->scanned, end, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&mc->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/* Count the matches of "len" bytes of "str" in "buf", a regex if "regex",
+ * once no key has been pressed for a while.
+ */
+static void match_count_new(struct buffer *buf, const char *str, int len, bool regex)
+{
+	struct match_count *mc;
+	const char *error;
+
+	mc = calloc(1, sizeof(struct match_count));
+	if (!mc)
+		oom();
+	mc->str = strndup(str, len);
+	if (!mc->str)
+		oom();
+	mc->len = len;
+	search_init(&mc->pat, mc->str, len);
+	if (regex)
+		mc->re = regex_compile(str, len, &error);
+	line_index_init(&mc->starts);
+	/* Unlike lines, there may be no match at 0. */
+	mc->starts.gap_start = 0;
+	mc->due = clock_ms() + SEARCH_DEBOUNCE_MS;
+	buf->matches = mc;
+}
+
+static void match_count_free(struct buffer *buf)
+{
+	struct match_count *mc = buf->matches;
+
+	if (!mc)
+		return;
+	__atomic_store_n(&mc->cancel, 1, __ATOMIC_RELAXED);
+	if (mc->started)
+		pthread_join(mc->thread, NULL);
+	if (mc->view)
+		parallel_view_free(mc->view);
+	if (mc->re)
+		regex_free(mc->re);
+	free(mc->starts.starts);
+	free(mc->str);
+	free(mc);
+	buf->matches = NULL;
+}
+
+/* Start counting the matches in "buf" when it is due, or take the count when
+ * it is done. Return true if there is more to show about it.
+ */
+static bool match_count_poll(struct buffer *buf)
+{
+	struct match_count *mc = buf->matches;
+	long long now;
+
+	if (!mc || mc->complete)
+		return false;
+	now = clock_ms();
+	if (!mc->view) {
+		if (now < mc->due)
+			return false;
+		mc->view = parallel_view_new(buf, &mc->cancel);
+		mc->shown = now;
+		mc->started = pthread_create(&mc->thread, NULL, match_count_run, mc) == 0;
+		if (!mc->started)
+			match_count_run(mc);
+	}
+	if (__atomic_load_n(&mc->done, __ATOMIC_ACQUIRE)) {
+		if (mc->started)
+			pthread_join(mc->thread, NULL);
+		mc->started = false;
+		parallel_view_free(mc->view);
+		mc->view = NULL;
+		mc->starts.indexed = buf->used;
+		mc->complete = true;
+		return true;
+	}
+	if (now - mc->shown < MATCH_COUNT_PROGRESS_MS)
+		return false;
+	mc->shown = now;
+	return true;
+}
+
+/* Get what is known about the matches: their number in "total" and the one
+ * at "pos" in "nth", counting from 1, or 0 if there is none.
+ * Return false if they are still being counted.
+ */
+static bool match_count_get(struct buffer *buf, int pos, int *total, int *nth)
+{
+	struct match_count *mc = buf->matches;
+	struct line_index *li = &mc->starts;
+	int lo = 0, hi;
+
+	*nth = 0;
+	if (!mc->complete) {
+		*total = mc->view ? __atomic_load_n(&mc->found, __ATOMIC_RELAXED) : 0;
+		return false;
+	}
+	*total = mc->total;
+	if (mc->overflow)
+		return true;
+
+	/* Find the first match at or after "pos". */
+	hi = line_index_count(li);
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (line_index_get(li, mid) < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < line_index_count(li) && line_index_get(li, lo) == pos)
+		*nth = lo + 1;
+
+	return true;
+}
+
+/* Drop a count that an edit of "buf" would leave wrong or that is still
+ * being read by another thread. Must be called before the text is modified.
+ */
+static void match_count_invalidate(struct buffer *buf)
+{
+	struct match_count *mc = buf->matches;
+
+	if (mc && (!mc->complete || mc->re || mc->overflow))
+		match_count_free(buf);
+}
+
+/* Update the count after "removed" bytes at "pos" were replaced by
+ * "inserted" bytes. Only the matches that could overlap them change.
+ */
+static void match_count_edit(struct buffer *buf, int pos, int removed, int inserted)
+{
+	struct match_count *mc = buf->matches;
+	struct line_index *li;
+	int lo, hi, beg;
+
+	if (!mc)
+		return;
+	li = &mc->starts;
+	beg = max(0, pos - mc->len + 1);
+
+	/* Forget the matches that ran into the old text... */
+	lo = 0;
+	hi = line_index_count(li);
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (line_index_get(li, mid) < beg)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	line_index_move_gap(li, lo);
+	while (li->gap_end < li->size && li->indexed - li->starts[li->gap_end] < pos + removed) {
+		li->gap_end++;
+		mc->total--;
+	}
+	li->indexed += inserted - removed;
+
+	/* ...and find the ones that run into the new text. */
+	match_count_range(mc, buf, beg, pos + inserted);
+}
+
+static void undo_log_clear(struct undo_log *ul)
+{
+	free(ul->ops);
+	free(ul->arena);
+	ul->ops = NULL;
+	ul->len = 0;
+	ul->done = 0;
+	ul->size = 0;
+	ul->arena = NULL;
+	ul->base = 0;
+	ul->used = 0;
+	ul->arena_size = 0;
+}
+
+/* Forget the "n" oldest edits and the text only they used. */
+static void undo_log_forget(struct undo_log *ul, int n)
+{
+	size_t dead;
+
+	memmove(ul->ops, ul->ops + n, (ul->len - n) * sizeof(struct undo_op));
+	ul->len -= n;
+	ul->done -= n;
+	dead = ul->len ? ul->ops[0].text - ul->base : ul->used;
+	memmove(ul->arena, ul->arena + dead, ul->used - dead);
+	ul->used -= dead;
+	ul->base += dead;
+}
+
+/* Make room for "n" more bytes at the end of the arena and return them, or
+ * NULL if the log can't hold that much.
+ */
+static char *undo_log_reserve(struct undo_log *ul, size_t n)
+{
+	size_t limit;
+	int k;
+
+	if (n > ul->max) {
+		undo_log_clear(ul);
+		return NULL;
+	}
+
+	/* Free a quarter of the arena at once, so that the edits after this
+	   one do not move the arena again. */
+	if (ul->used + n > ul->max) {
+		limit = ul->max - ul->max / 4;
+		for (k = 0; k < ul->len; k++) {
+			if (ul->base + ul->used - ul->ops[k].text + n <= limit)
+				break;
+		}
+		undo_log_forget(ul, k);
+	}
+
+	if (ul->used + n > ul->arena_size) {
+		ul->arena_size *= 2;
+		if (ul->arena_size < ul->used + n)
+			ul->arena_size = ul->used + n;
+		if (ul->arena_size > ul->max)
+			ul->arena_size = ul->max;
+		ul->arena = realloc(ul->arena, ul->arena_size);
+		if (!ul->arena)
+			oom();
+	}
+	ul->used += n;
+
+	return ul->arena + ul->used - n;
+}
+
+/* Record an edit of "len" bytes at "pos" before it is made. Deleted text
+ * is copied from the buffer, inserted text from "str".
+ */
+static void undo_record(struct buffer *buf, bool insert, int pos, const char *str, int len)
+{
+	struct undo_log *ul = &buf->undo;
+	struct undo_op *last;
+	char *p;
+
+	if (ul->suspended || ul->max == 0)
+		return;
+
+	/* A new edit makes the ones undone impossible to redo. */
+	if (ul->done < ul->len) {
+		ul->len = ul->done;
+		last = ul->len ? &ul->ops[ul->len - 1] : NULL;
+		ul->used = last ? last->text + last->len - ul->base : 0;
+	}
+
+	last = ul->len ? &ul->ops[ul->len - 1] : NULL;
+	if (insert && len == 1 && *str != '\n' && last && last->typed
+	    && last->pos + last->len == pos
+	    && last->text + last->len == ul->base + (long long)ul->used
+	    && ul->used < ul->max) {
+		*undo_log_reserve(ul, 1) = *str;
+		last->len++;
+		return;
+	}
+
+	p = undo_log_reserve(ul, len);
+	if (!p)
+		return;
+	if (insert)
+		memcpy(p, str, len);
+	else
+		buffer_copy(buf, pos, len, p);
+
+	if (ul->len == ul->size) {
+		ul->size += UNDO_ALLOC_CHUNK;
+		ul->ops = realloc(ul->ops, ul->size * sizeof(struct undo_op));
+		if (!ul->ops)
+			oom();
+	}
+	ul->ops[ul->len++] = (struct undo_op){
+		.pos = pos,
+		.len = len,
+		.text = ul->base + ul->used - len,
+		.insert = insert,
+		.typed = insert && len == 1 && *str != '\n',
+	};
+	ul->done = ul->len;
+}
+
 static void buffer_set_name(struct buffer *buf, const char *name)
 {
 	if (buf->name)
@@ -196,27 +765,218 @@ struct buffer *buffer_new(void)
 	if (!buf->data)
 		oom();
 	buf->gap_end = buf->size;
+	line_index_init(&buf->lines);
+	column_cache_reset_all(buf);
+	buf->undo.max = (size_t)UNDO_LOG_MAX_MB << 20;
 	buffer_set_name(buf, "*Untitled*");
 
 	return buf;
 }
 
-int buffer_save(struct buffer *buf, const char *path)
+void buffer_free(struct buffer *buf)
 {
-	FILE *fp;
+	match_count_free(buf);
+	if (buf->pieces)
+		piece_table_free(buf->pieces);
+	if (buf->rope)
+		rope_free(buf->rope);
+	free(buf->data);
+	free(buf->lines.starts);
+	column_cache_free(buf);
+	wrap_map_free(&buf->wrap);
+	undo_log_clear(&buf->undo);
+	free(buf->name);
+	free(buf->path);
+	free(buf);
+}
 
-	fp = fopen(path, "w+");
-	if (!fp)
-		return -1;
+/* Switch the buffer over to a piece table on top of the first "size" bytes
+ * of the file at "path". The text is not read, only mapped.
+ */
+static int buffer_map(struct buffer *buf, const char *path, int size)
+{
+	struct piece_table *pt;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	pt = piece_table_map(fd, size);
+	close(fd);
+	if (!pt)
+		return -errno;
+
+	if (buf->pieces)
+		piece_table_free(buf->pieces);
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+	buf->gap_start = 0;
+	buf->gap_end = 0;
+	buf->pieces = pt;
+	buf->storage = STORAGE_PIECE;
+	buf->used = size;
 
-	if (fwrite(buf->data, 1, buf->gap_start, fp) == 0)
-		if (ferror(fp))
-		    return -1;
-	if (buf->gap_end != buf->size)
-		if (fwrite(buf->data + buf->gap_end, 1, buf->size - buf->gap_end, fp) == 0)
-			if (ferror(fp))
+	return 0;
+}
+
+/* Switch the (empty) buffer over to a rope holding the file at "path". */
+static int buffer_read_rope(struct buffer *buf, const char *path)
+{
+	struct rope *r;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	r = rope_read(fd);
+	close(fd);
+	if (!r)
+		return -errno;
+
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+	buf->gap_start = 0;
+	buf->gap_end = 0;
+	buf->rope = r;
+	buf->storage = STORAGE_ROPE;
+	buf->used = rope_length(r);
+
+	return 0;
+}
+
+/* Write all of the text to "fd", handing writev as many spans at a time
+   as it takes: the two sides of the gap, or the pieces of the other
+   storages. */
+static int buffer_write(struct buffer *buf, int fd)
+{
+	struct iovec iov[BUFFER_WRITE_SPANS];
+	int pos = 0, n, i;
+	ssize_t written;
+
+	while (pos < buf->used) {
+		for (n = 0; n < BUFFER_WRITE_SPANS && pos < buf->used; n++) {
+			const char *data;
+			int len;
+
+			len = buffer_span_at(buf, pos, &data);
+			iov[n].iov_base = (char *)data;
+			iov[n].iov_len = len;
+			pos += len;
+		}
+		for (i = 0; i < n;) {
+			written = writev(fd, iov + i, n - i);
+			if (written < 0) {
+				if (errno == EINTR)
+					continue;
 				return -1;
-	fclose(fp);
+			}
+			while (i < n && written >= iov[i].iov_len)
+				written -= iov[i++].iov_len;
+			if (i < n) {
+				iov[i].iov_base = (char *)iov[i].iov_base + written;
+				iov[i].iov_len -= written;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Give the new file open at "fd" the mode and, as far as we are allowed,
+   the owner of the one at "path", or the usual mode if there is none. */
+static void buffer_copy_attributes(int fd, const char *path)
+{
+	struct stat sb;
+	mode_t mask;
+
+	if (stat(path, &sb) < 0) {
+		mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+		return;
+	}
+	/* Changing the owner clears the set-id bits, so do it first. Only root
+	   can give the file away, but the group may still be allowed. */
+	if (fchown(fd, sb.st_uid, sb.st_gid) < 0)
+		fchown(fd, -1, sb.st_gid);
+	fchmod(fd, sb.st_mode & 07777);
+}
+
+/* Flush the directory entry of "path" to disk, so that a rename into it
+ * survives a crash.
+ */
+static void buffer_sync_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir;
+	int fd;
+
+	if (!slash)
+		dir = strdup(".");
+	else if (slash == path)
+		dir = strdup("/");
+	else
+		dir = strndup(path, slash - path);
+	if (!dir)
+		oom();
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+}
+
+/* Write the text to a temporary file next to "path", sync it and rename it
+ * over the original. A crash or a full disk leaves either the old file or
+ * the new one, never a truncated mix of them. A symbolic link is followed,
+ * so that the link stays and the file it points to is replaced.
+ *
+ * A mapped buffer still reads unmodified text from the original file, so
+ * that can't be written over either. The rename keeps the old file alive
+ * for as long as it is mapped.
+ */
+static int buffer_save_atomic(struct buffer *buf, const char *path)
+{
+	char *real, *tmp;
+	int fd, rc = -1;
+
+	real = realpath(path, NULL);
+	if (asprintf(&tmp, "%s.XXXXXX", real ? real : path) < 0)
+		oom();
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out;
+	buffer_copy_attributes(fd, real ? real : path);
+	rc = buffer_write(buf, fd);
+	if (rc == 0)
+		rc = fsync(fd);
+	if (close(fd) < 0)
+		rc = -1;
+	if (rc == 0)
+		rc = rename(tmp, real ? real : path);
+	if (rc < 0) {
+		unlink(tmp);
+		goto out;
+	}
+	buffer_sync_dir(tmp);
+out:
+	free(tmp);
+	free(real);
+	return rc;
+}
+
+int buffer_save(struct buffer *buf, const char *path)
+{
+	/* Saving may remap the text from under a count in the background. */
+	match_count_invalidate(buf);
+	if (buffer_save_atomic(buf, path) < 0)
+		return -1;
+	/* Map the new file, so that the old one and the edits can be dropped. */
+	if (buf->storage == STORAGE_PIECE)
+		buffer_map(buf, path, buf->used);
 
 	buffer_set_path(buf, path);
 	buf->modified = false;
@@ -225,7 +985,10 @@ int buffer_save(struct buffer *buf, const char *path)
 
 }
 
-int buffer_load(struct buffer *buf, const char *path)
+/* Load the file at "path" into the buffer.
+ * Large files are kept in the given "storage", others in a gap buffer.
+ */
+int buffer_load(struct buffer *buf, const char *path, enum storage storage)
 {
 	struct stat sb;
 
@@ -247,23 +1010,42 @@ int buffer_load(struct buffer *buf, const char *path)
 		} else if (!S_ISREG(sb.st_mode)) {
 			errno = ENOTSUP;
 			return -errno;
+		} else if (sb.st_size > INT_MAX) {
+			errno = EFBIG;
+			return -errno;
+		}
+
+		/* If large files can't be mapped, read them like any other. */
+		if (sb.st_size >= BUFFER_LARGE_FILE && buf->used == 0) {
+			if (storage == STORAGE_PIECE && buffer_map(buf, path, sb.st_size) == 0)
+				goto loaded;
+			if (storage == STORAGE_ROPE && buffer_read_rope(buf, path) == 0)
+				goto loaded;
 		}
 
 		/* At this point, fopen() should always succeed. */
 		fp = fopen(path, "r");
 		assert(fp);
 
-		tmp_buf = malloc(BUFFER_ALLOC_CHUNK);
+		buffer_reserve(buf, sb.st_size);
+		tmp_buf = malloc(BUFFER_READ_CHUNK);
 		assert(tmp_buf);
-		while ((read = fread(tmp_buf, 1, BUFFER_ALLOC_CHUNK, fp)) > 0)
+		buf->undo.suspended = true;
+		while ((read = fread(tmp_buf, 1, BUFFER_READ_CHUNK, fp)) > 0)
 			buffer_insert_string(buf, tmp_buf, read);
+		buf->undo.suspended = false;
 		free(tmp_buf);
 		fclose(fp);
 	}
+loaded:
 	buffer_set_path(buf, path);
 	buf->modified = false;
 	buf->cursor = 0;
 	buf->cur_line = 0;
+	buf->cursor_column = 0;
+	column_cache_reset_all(buf);
+	wrap_map_reset(&buf->wrap);
+	undo_log_clear(&buf->undo);
 
 	return 0;
 }
@@ -290,13 +1072,127 @@ int cursor_to_data(struct buffer *buf, int pos)
 	return pos;
 }
 
+/* Point "data" at the text stored from position "pos" on.
+ * Return the number of contiguous bytes, 0 at the end of the buffer.
+ */
+static int buffer_span_at(struct buffer *buf, int pos, const char **data)
+{
+	if (buf->storage == STORAGE_PIECE)
+		return piece_table_span(buf->pieces, pos, data);
+	if (buf->storage == STORAGE_ROPE)
+		return rope_span(buf->rope, pos, data);
+
+	*data = buf->data + cursor_to_data(buf, pos);
+	if (pos < buf->gap_start)
+		return buf->gap_start - pos;
+	return buf->used - pos;
+}
+
+/* Point "data" at the text stored right before position "pos".
+ * Return the number of contiguous bytes, 0 at the beginning of the buffer.
+ */
+static int buffer_span_before(struct buffer *buf, int pos, const char **data)
+{
+	if (buf->storage == STORAGE_PIECE)
+		return piece_table_span_before(buf->pieces, pos, data);
+	if (buf->storage == STORAGE_ROPE)
+		return rope_span_before(buf->rope, pos, data);
+
+	if (pos <= buf->gap_start) {
+		*data = buf->data;
+		return pos;
+	}
+	*data = buf->data + buf->gap_end;
+	return pos - buf->gap_start;
+}
+
+/* Return true if another thread reading "buf" has been told to stop. */
+static bool buffer_cancelled(struct buffer *buf)
+{
+	int found;
+
+	if (buf->cancel && __atomic_load_n(buf->cancel, __ATOMIC_RELAXED))
+		return true;
+	if (!buf->found)
+		return false;
+	found = __atomic_load_n(buf->found, __ATOMIC_RELAXED);
+	return found >= 0 && found < buf->chunk;
+}
+
+/* Get the contiguous run of text from "pos" on, but not past "end".
+ * Walk the text forward with:
+ *
+ *	for (p = beg; buffer_span_forward(buf, p, end, &sp); p += sp.len)
+ *
+ * Return false when there is nothing left.
+ */
+bool buffer_span_forward(struct buffer *buf, int pos, int end, struct span *sp)
+{
+	end = min(end, buf->used);
+	if (pos >= end || buffer_cancelled(buf))
+		return false;
+	sp->len = min(buffer_span_at(buf, pos, &sp->data), end - pos);
+	if (buf->cancel || buf->found)
+		sp->len = min(sp->len, BUFFER_CANCEL_SPAN);
+	sp->pos = pos;
+
+	return sp->len > 0;
+}
+
+/* Get the contiguous run of text right before "pos", but not before "beg".
+ * Walk the text backward with:
+ *
+ *	for (p = end; buffer_span_backward(buf, p, beg, &sp); p -= sp.len)
+ *
+ * Return false when there is nothing left.
+ */
+bool buffer_span_backward(struct buffer *buf, int pos, int beg, struct span *sp)
+{
+	int len;
+
+	beg = max(beg, 0);
+	pos = min(pos, buf->used);
+	if (pos <= beg || buffer_cancelled(buf))
+		return false;
+	len = buffer_span_before(buf, pos, &sp->data);
+	if (buf->cancel || buf->found)
+		beg = max(beg, pos - BUFFER_CANCEL_SPAN);
+	if (len > pos - beg) {
+		sp->data += len - (pos - beg);
+		len = pos - beg;
+	}
+	sp->len = len;
+	sp->pos = pos - len;
+
+	return len > 0;
+}
+
 char buffer_data_at(struct buffer *buf, int pos)
 {
 	if (!is_position_in_buffer(pos, buf))
 		return -1;
+	if (buf->storage == STORAGE_PIECE)
+		return piece_table_byte_at(buf->pieces, pos);
+	if (buf->storage == STORAGE_ROPE)
+		return rope_byte_at(buf->rope, pos);
 	return buf->data[cursor_to_data(buf, pos)];
 }
 
+/* Copy "n" bytes of text starting at position "pos" to "dst". */
+void buffer_copy(struct buffer *buf, int pos, int n, char *dst)
+{
+	while (n > 0) {
+		const char *data;
+		int len;
+
+		len = min(buffer_span_at(buf, pos, &data), n);
+		memcpy(dst, data, len);
+		dst += len;
+		pos += len;
+		n -= len;
+	}
+}
+
 void buffer_expand(struct buffer *buf, size_t chunk)
 {
 	int size = buf->size + chunk;
@@ -310,6 +1206,60 @@ void buffer_expand(struct buffer *buf, size_t chunk)
 	buf->gap_end += chunk;
 }
 
+/* Large buffers are moved around with memmove() a lot, let the kernel back
+ * them with huge pages to cut down on TLB misses and page faults.
+ */
+static void buffer_advise(struct buffer *buf)
+{
+#ifdef MADV_HUGEPAGE
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t beg, end;
+
+	if (buf->size < BUFFER_ADVISE_THRESHOLD)
+		return;
+	beg = ((uintptr_t)buf->data + page - 1) & ~(page - 1);
+	end = ((uintptr_t)buf->data + buf->size) & ~(page - 1);
+	madvise((void *)beg, end - beg, MADV_HUGEPAGE);
+#endif
+}
+
+/* Make sure that at least "n" more bytes fit into the gap.
+ * The buffer grows geometrically, so that a series of inserts costs amortized
+ * O(1) per byte instead of a realloc() and memmove() every few bytes.
+ */
+void buffer_reserve(struct buffer *buf, size_t n)
+{
+	size_t gap = buf->gap_end - buf->gap_start, size;
+
+	if (buf->storage != STORAGE_GAP || gap >= n)
+		return;
+
+	size = buf->size + buf->size / 2;
+	if (size < buf->used + n + BUFFER_ALLOC_CHUNK)
+		size = buf->used + n + BUFFER_ALLOC_CHUNK;
+	buffer_expand(buf, size - buf->size);
+	buffer_advise(buf);
+}
+
+/* Give memory back once a large buffer is mostly gap.
+ * The buffer is left half full, so that it doesn't have to grow right away.
+ */
+static void buffer_shrink(struct buffer *buf)
+{
+	size_t size, tail;
+
+	if (buf->size < BUFFER_SHRINK_THRESHOLD || buf->used > buf->size / 4)
+		return;
+
+	size = max(buf->used * 2, BUFFER_ALLOC_CHUNK);
+	tail = buf->size - buf->gap_end;
+	memmove(buf->data + size - tail, buf->data + buf->gap_end, tail);
+	buf->data = realloc(buf->data, size);
+	assert(buf->data);
+	buf->gap_end = size - tail;
+	buf->size = size;
+}
+
 void buffer_adjust_gap(struct buffer *buf)
 {
 	int p, n;
@@ -342,80 +1292,346 @@ void buffer_adjust_gap(struct buffer *buf)
 
 int buffer_get_next_newline(struct buffer *buf, int from, int way)
 {
-	int d = (way > 0) ? 1 : -1;
-	char c;
-
-	from += d;
-	while (from >= 0 && from < buf->used) {
-		c = buffer_data_at(buf, from);
-		if (is_utf8(c) && c == '\n')
-			return from;
-		else
-			from += d;
+	struct span sp;
+	const char *nl;
+	int p, nth = 1;
+
+	if (way > 0) {
+		for (p = from + 1; buffer_span_forward(buf, p, buf->used, &sp); p += sp.len) {
+			nl = newline_find(sp.data, sp.len, &nth);
+			if (nl)
+				return sp.pos + (nl - sp.data);
+		}
+	} else {
+		for (p = from; buffer_span_backward(buf, p, 0, &sp); p -= sp.len) {
+			nl = newline_rfind(sp.data, sp.len, &nth);
+			if (nl)
+				return sp.pos + (nl - sp.data);
+		}
 	}
 
 	return -1;
 }
 
+/* The line index already knows where lines begin, so neither end of a line
+ * has to be searched for.
+ */
 int buffer_get_line_beginning(struct buffer *buf)
 {
-	int nl;
+	return buffer_line_start(buf, buffer_line_at(buf, buf->cursor));
+}
 
-	nl = buffer_get_next_newline(buf, buf->cursor, -1);
-	if (nl < 0)
-		return 0;
+int buffer_get_line_end(struct buffer *buf)
+{
+	int next;
+
+	next = buffer_line_start(buf, buffer_line_at(buf, buf->cursor) + 1);
+	if (next < 0)
+		return buf->used;
 
-	return nl + 1;
+	return next - 1;
 }
 
-int buffer_get_line_end(struct buffer *buf)
+/* Drop the checkpoints an edit of "removed" bytes at "pos", replaced by
+ * "inserted" bytes, can change. Lines after the edit only move.
+ */
+static void column_cache_edit(struct buffer *buf, int pos, int removed, int inserted)
+{
+	struct column_cache *cc;
+	int i, n;
+
+	for (i = 0; i < COLUMN_CACHE_LINES; i++) {
+		cc = &buf->columns[i];
+		if (cc->line_start < 0)
+			continue;
+		if (pos + removed < cc->line_start) {
+			cc->line_start += inserted - removed;
+			if (cc->line_end >= 0)
+				cc->line_end += inserted - removed;
+			continue;
+		}
+		if (pos < cc->line_start) {
+			column_cache_reset(cc);
+			continue;
+		}
+		if (cc->line_end >= 0 && pos > cc->line_end)
+			continue;
+
+		/* A checkpoint only depends on the text before it. */
+		n = (pos - cc->line_start) / COLUMN_CHECKPOINT + 1;
+		if (cc->len > n)
+			cc->len = n;
+		cc->line_end = -1;
+	}
+}
+
+static void column_cache_add(struct column_cache *cc, int col)
 {
-	int nl;
+	if (cc->len == cc->size) {
+		cc->size += COLUMN_CACHE_ALLOC_CHUNK;
+		cc->cols = realloc(cc->cols, cc->size * sizeof(int));
+		if (!cc->cols)
+			oom();
+	}
+	cc->cols[cc->len++] = col;
+}
 
-	if (buf->used == 0)
+/* How much it would cost to forget a cached line: nothing for an unused
+ * entry, little for a line shorter than a checkpoint interval.
+ */
+static int column_cache_worth(const struct column_cache *cc)
+{
+	if (cc->line_start < 0)
 		return 0;
+	if (cc->line_end >= 0 && cc->len == 1)
+		return 1;
+	return 2;
+}
 
-	nl = buffer_get_next_newline(buf, buf->cursor - 1, 1);
-	if (nl < 0)
-		return buf->used;
+/* Return the cache of the line beginning at "start". A line not cached yet
+ * takes the place of the one least worth keeping, and of those the one used
+ * least recently.
+ */
+static struct column_cache *column_cache_line(struct buffer *buf, int start)
+{
+	struct column_cache *cc, *victim = NULL;
+	int i;
 
-	return nl;
+	for (i = 0; i < COLUMN_CACHE_LINES; i++) {
+		cc = &buf->columns[i];
+		if (cc->line_start == start)
+			goto out;
+		if (!victim || column_cache_worth(cc) < column_cache_worth(victim)
+		    || (column_cache_worth(cc) == column_cache_worth(victim)
+			&& cc->last_used < victim->last_used))
+			victim = cc;
+	}
+
+	cc = victim;
+	column_cache_reset(cc);
+	cc->line_start = start;
+	column_cache_add(cc, 0);
+out:
+	cc->last_used = ++buf->columns_clock;
+	return cc;
 }
 
-/* Get cursor offset on the current line.
- * Number of characters is returned.
- * UTF-8 friendly.
+/* Advance column "col" over the text from "from" up to "to" or the end of
+ * the line, whichever comes first. The end of the line is returned in "end",
+ * or -1 if it was not reached.
  */
-int buffer_get_line_offset(struct buffer *buf)
+static int column_scan(struct buffer *buf, int from, int to, int col, int *end)
 {
-	int p, x = 0;
-	char c;
+	struct span sp;
+	int p, i;
+
+	*end = -1;
+	for (p = from; buffer_span_forward(buf, p, to, &sp); p += sp.len) {
+		for (i = 0; i < sp.len; i++) {
+			if (sp.data[i] == '\n') {
+				*end = sp.pos + i;
+				return col;
+			}
+			if (!is_utf8(sp.data[i]))
+				continue;
+			if (sp.data[i] == '\t')
+				col += TAB_STOP - col % TAB_STOP;
+			else
+				col++;
+		}
+	}
+	if (to >= (int)buf->used)
+		*end = buf->used;
 
-	p = buffer_get_line_beginning(buf);
+	return col;
+}
+
+/* Compute one more checkpoint, or find the end of the line instead.
+ * Return false if the whole line is known already.
+ */
+static bool column_cache_extend(struct buffer *buf, struct column_cache *cc)
+{
+	int p, col, end;
+
+	if (cc->line_end >= 0)
+		return false;
+
+	p = cc->line_start + (cc->len - 1) * COLUMN_CHECKPOINT;
+	col = column_scan(buf, p, min(p + COLUMN_CHECKPOINT, (int)buf->used),
+			  cc->cols[cc->len - 1], &end);
+	if (end >= 0)
+		cc->line_end = end;
+	else
+		column_cache_add(cc, col);
+
+	return true;
+}
 
-	while (p < buf->cursor) {
-		c = buffer_data_at(buf, p);
-		if (is_utf8(c)) {
-			if (buffer_data_at(buf, p) == '\t')
+/* Return the display column of "pos" on its line. */
+static int buffer_column_at(struct buffer *buf, int pos)
+{
+	struct column_cache *cc;
+	int i, end;
+
+	cc = column_cache_line(buf, buffer_line_start(buf, buffer_line_at(buf, pos)));
+	i = (pos - cc->line_start) / COLUMN_CHECKPOINT;
+	while (i >= cc->len && column_cache_extend(buf, cc))
+		;
+	if (i >= cc->len)
+		i = cc->len - 1;
+
+	return column_scan(buf, cc->line_start + i * COLUMN_CHECKPOINT, pos,
+			   cc->cols[i], &end);
+}
+
+/* Return the first character of the line beginning at "start" that is at
+ * display column "col" or past it, or the end of the line if it is shorter.
+ */
+static int buffer_column_find(struct buffer *buf, int start, int col)
+{
+	struct column_cache *cc;
+	struct span sp;
+	int lo, hi, p, i, x;
+
+	cc = column_cache_line(buf, start);
+	while (cc->cols[cc->len - 1] < col && column_cache_extend(buf, cc))
+		;
+
+	/* Find the last checkpoint before the column. */
+	lo = 0;
+	hi = cc->len - 1;
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+
+		if (cc->cols[mid] < col)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	x = cc->cols[lo];
+	p = start + lo * COLUMN_CHECKPOINT;
+	for (; buffer_span_forward(buf, p, buf->used, &sp); p += sp.len) {
+		for (i = 0; i < sp.len; i++) {
+			if (sp.data[i] == '\n')
+				return sp.pos + i;
+			if (!is_utf8(sp.data[i]))
+				continue;
+			if (x >= col)
+				return sp.pos + i;
+			if (sp.data[i] == '\t')
 				x += TAB_STOP - x % TAB_STOP;
 			else
 				x++;
 		}
-		p++;
 	}
-	return x;
+
+	return buf->used;
+}
+
+/* Forget the heights an edit of "removed" bytes at "pos", replaced by
+ * "str", can change.
+ */
+static void wrap_map_edit(struct buffer *buf, int pos, int removed, const char *str, int inserted)
+{
+	struct wrap_map *wm = &buf->wrap;
+	bool lines_changed;
+	int line;
+
+	if (wm->len == 0)
+		return;
+
+	line = buffer_line_at(buf, pos);
+	lines_changed = (str && memchr(str, '\n', inserted))
+		|| (removed && buffer_line_at(buf, pos + removed) != line);
+	if (line < wm->first) {
+		if (lines_changed)
+			wrap_map_reset(wm);
+	} else if (line < wm->first + wm->len) {
+		if (lines_changed)
+			wm->len = line - wm->first;
+		else
+			wm->rows[line - wm->first] = -1;
+	}
+}
+
+/* Return the number of rows "line" takes when wrapped at "width" columns,
+ * or "limit" if it takes more: then the line is only read as far as that
+ * row. A line ending right at a row boundary takes one more row, for the
+ * cursor to be at its end.
+ */
+static int buffer_line_rows(struct buffer *buf, int line, int width, int limit)
+{
+	struct wrap_map *wm = &buf->wrap;
+	int n, i, next, end;
+
+	if (!wm->rows) {
+		wm->rows = malloc(WRAP_MAP_LINES * sizeof(int));
+		if (!wm->rows)
+			oom();
+	}
+	if (wm->width != width) {
+		wm->width = width;
+		wrap_map_reset(wm);
+	}
+
+	/* Keep the lines next to the ones known, forget the farthest. */
+	if (wm->len == 0 || line < wm->first - WRAP_MAP_LINES / 2
+	    || line >= wm->first + wm->len + WRAP_MAP_LINES / 2) {
+		wm->first = line;
+		wm->len = 0;
+	} else if (line < wm->first) {
+		n = wm->first - line;
+		wm->len = min(wm->len + n, WRAP_MAP_LINES);
+		memmove(wm->rows + n, wm->rows, (wm->len - n) * sizeof(int));
+		for (i = 0; i < n; i++)
+			wm->rows[i] = -1;
+		wm->first = line;
+	}
+	while (line >= wm->first + wm->len) {
+		if (wm->len == WRAP_MAP_LINES) {
+			n = WRAP_MAP_LINES / 2;
+			memmove(wm->rows, wm->rows + n, (wm->len - n) * sizeof(int));
+			wm->first += n;
+			wm->len -= n;
+		}
+		wm->rows[wm->len++] = -1;
+	}
+
+	i = line - wm->first;
+	if (wm->rows[i] < 0) {
+		next = buffer_line_start(buf, line + 1);
+		end = (next < 0) ? buf->used : next - 1;
+		/* Something shows past the last row counted, the rest of the
+		   line is not worth reading. */
+		if (limit < INT_MAX / width &&
+		    buffer_column_find(buf, buffer_line_start(buf, line), limit * width) < end)
+			return limit;
+		wm->rows[i] = buffer_column_at(buf, end) / width + 1;
+	}
+
+	return min(wm->rows[i], limit);
+}
+
+/* Get cursor offset on the current line.
+ * Number of characters is returned.
+ * UTF-8 friendly.
+ */
+int buffer_get_line_offset(struct buffer *buf)
+{
+	return buffer_column_at(buf, buf->cursor);
 }
 
 int buffer_get_line_length(struct buffer *buf)
 {
-	int p, end, l = 0;
+	struct span sp;
+	int p, i, end, l = 0;
 
 	p = buffer_get_line_beginning(buf);
 	end = buffer_get_line_end(buf);
-	while (p < end) {
-		if (is_utf8(buffer_data_at(buf, p)))
-			l++;
-		p++;
+	for (; buffer_span_forward(buf, p, end, &sp); p += sp.len) {
+		for (i = 0; i < sp.len; i++)
+			l += is_utf8(sp.data[i]);
 	}
 
 	return l;
@@ -428,19 +1644,12 @@ int buffer_get_line_length(struct buffer *buf)
  */
 void buffer_get_region(struct buffer *buf, int line_start, int lines, int *beg, int *end)
 {
-	int p, l = 0;
+	int p;
 
-	/* TODO: move into buffer_goto_line() or similar */
-	for (p = 0; p < buf->used && l != line_start; p++) {
-		if (buffer_data_at(buf, p) == '\n')
-			l++;
-	}
-	*beg = p;
-	for (l = 0; p < buf->used && l < lines; p++) {
-		if (buffer_data_at(buf, p) == '\n')
-			l++;
-	}
-	*end = p - 1;
+	p = buffer_line_start(buf, line_start);
+	*beg = (p < 0) ? buf->used : p;
+	p = buffer_line_start(buf, line_start + lines);
+	*end = ((p < 0) ? buf->used : p) - 1;
 }
 
 void buffer_get_yx(struct buffer *buf, int *y, int *x)
@@ -449,6 +1658,14 @@ void buffer_get_yx(struct buffer *buf, int *y, int *x)
 	*x = buffer_get_line_offset(buf);
 }
 
+/* Move the cursor to "pos" and look up its line in the line index. */
+void buffer_set_cursor(struct buffer *buf, int pos)
+{
+	buf->cursor = pos;
+	buf->cur_line = buffer_line_at(buf, pos);
+	buffer_cursor_column_update(buf);
+}
+
 char *buffer_get_content(struct buffer *buf)
 {
 	char *text;
@@ -456,15 +1673,63 @@ char *buffer_get_content(struct buffer *buf)
 	text = malloc(buf->used + 1);
 	if (!text)
 		oom();
-	memcpy(text, buf->data, buf->gap_start);
-	memcpy(text + buf->gap_start, buf->data + buf->gap_end, buf->size - buf->gap_end);
+	buffer_copy(buf, 0, buf->used, text);
 	text[buf->used] = '\0';
 
 	return text;
 }
 
-/* TODO: util functions needed for buffer operations: */
-/* strstr() and reverse */
+/* Return the position of the beginning of "line", or -1 if there is no such line. */
+int buffer_line_start(struct buffer *buf, int line)
+{
+	struct line_index *li = &buf->lines;
+
+	if (buf->storage == STORAGE_ROPE)
+		return rope_line_start(buf->rope, line);
+	if (line < 0)
+		return -1;
+	while (line >= line_index_count(li) && li->indexed < buf->used)
+		line_index_extend(buf, li->indexed + 1);
+	if (line >= line_index_count(li))
+		return -1;
+
+	return line_index_get(li, line);
+}
+
+/* Return the line containing position "pos".
+ * Positions past the end of the buffer belong to the last line.
+ */
+int buffer_line_at(struct buffer *buf, int pos)
+{
+	struct line_index *li = &buf->lines;
+	int lo, hi;
+
+	if (buf->storage == STORAGE_ROPE)
+		return rope_line_at(buf->rope, pos);
+	line_index_extend(buf, pos);
+	lo = 0;
+	hi = line_index_count(li) - 1;
+
+	/* Find the last line beginning at or before "pos". */
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+
+		if (line_index_get(li, mid) <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+int buffer_last_line(struct buffer *buf)
+{
+	if (buf->storage == STORAGE_ROPE)
+		return rope_newlines(buf->rope);
+	line_index_extend(buf, buf->used);
+	return line_index_count(&buf->lines) - 1;
+}
 
 /* TODO: buffer_find_char() and friends could be used to find newlines in text as well. */
 
@@ -475,24 +1740,33 @@ char *buffer_get_content(struct buffer *buf)
  */
 int buffer_find_char(struct buffer *buf, int from, int way, const char *accept, int *newlines)
 {
-	int p = from;
+	bool set[256] = {false};
+	struct span sp;
+	int p, i;
 
-	if (!is_position_in_buffer(p, buf))
+	if (!is_position_in_buffer(from, buf))
 		return -1;
 
+	while (*accept != '\0')
+		set[(unsigned char)*accept++] = true;
+
 	*newlines = 0;
-	while (is_position_in_buffer(p, buf)) {
-		const char *a = accept;
-		char c;
-
-		c = buffer_data_at(buf, p);
-		while (*a != '\0') {
-			if (*a++ == c)
-				return p;
+	if (way > 0) {
+		for (p = from; buffer_span_forward(buf, p, buf->used, &sp); p += sp.len) {
+			for (i = 0; i < sp.len; i++) {
+				if (set[(unsigned char)sp.data[i]])
+					return sp.pos + i;
+				*newlines += sp.data[i] == '\n';
+			}
+		}
+	} else {
+		for (p = from + 1; buffer_span_backward(buf, p, 0, &sp); p -= sp.len) {
+			for (i = sp.len - 1; i >= 0; i--) {
+				if (set[(unsigned char)sp.data[i]])
+					return sp.pos + i;
+				*newlines += sp.data[i] == '\n';
+			}
 		}
-		if (c == '\n')
-			(*newlines)++;
-		p += way;
 	}
 
 	return -1;
@@ -508,59 +1782,50 @@ int buffer_find_char_prev(struct buffer *buf, int from, const char *accept, int
 	return buffer_find_char(buf, from, -1, accept, newlines);
 }
 
+/* Find "str" at "from" or after it.
+ * Return the distance to it and the number of lines passed in "newlines",
+ * or -1 if not found.
+ */
 int buffer_find_str_next(struct buffer *buf, int from, const char *str, int *newlines)
 {
-	char *text, *start, *s;
-	int p = -1;
+	int p;
 
-	text = buffer_get_content(buf);
-	start = text + from;
-	s = strstr(start, str);
 	*newlines = 0;
-	if (s) {
-		p = s - start;
-		*newlines = str_newlines(start, p);
-	}
-	free(text);
+	p = search_forward(buf, from, str, strlen(str));
+	if (p < 0)
+		return -1;
+	*newlines = buffer_line_at(buf, p) - buffer_line_at(buf, from);
 
-	return p;
+	return p - from;
 }
+
+/* Find "str" before "from".
+ * Return its position and its line in "newlines", or -1 if not found.
+ */
 int buffer_find_str_prev(struct buffer *buf, int from, const char *str, int *newlines)
 {
-	char *text, *s;
-	int p = -1;
-
-	text = buffer_get_content(buf);
+	int p;
 
 	*newlines = 0;
-	/* TODO: If the stars ever align correctly, this mess should be simplified... */
-	s = strstr(text, str);
-	if (s) {
-		while (1) {
-			int len;
-
-			s = strstr(text + p + 1, str);
-			if (s) {
-				len = s - (text + p);
-				if (p + len < from)
-					p += len;
-				else
-					break;
-			} else {
-				break;
-			}
-		}
-		*newlines += str_newlines(text, p);
-
-	}
-	free(text);
+	p = search_backward(buf, from, str, strlen(str));
+	if (p >= 0)
+		*newlines = buffer_line_at(buf, p);
 
 	return p;
 }
 
+/* The column is only computed once somebody asks for it. */
 static void buffer_cursor_column_update(struct buffer *buf)
 {
-	buf->cursor_column = buffer_get_line_offset(buf);
+	buf->cursor_column = -1;
+}
+
+static int buffer_cursor_column(struct buffer *buf)
+{
+	if (buf->cursor_column < 0)
+		buf->cursor_column = buffer_get_line_offset(buf);
+
+	return buf->cursor_column;
 }
 
 void buffer_move_forward_char(struct buffer *buf)
@@ -607,35 +1872,32 @@ void buffer_move_backward_word(struct buffer *buf)
 
 void buffer_move_forward_line(struct buffer *buf)
 {
-	int ll, cc;
-
-	cc = buf->cursor_column;
+	int start, cc;
 
-	buffer_move_end_of_line(buf);
-	buffer_move_forward_char(buf);
+	cc = buffer_cursor_column(buf);
 
-	ll = buffer_get_line_length(buf);
-	while (buffer_get_line_offset(buf) < cc
-	       && buffer_get_line_offset(buf) < ll)
-		buffer_move_forward_char(buf);
+	start = buffer_line_start(buf, buf->cur_line + 1);
+	if (start < 0) {
+		buffer_move_end_of_line(buf);
+	} else {
+		buf->cursor = buffer_column_find(buf, start, cc);
+		buf->cur_line++;
+		buffer_selection_update(buf);
+	}
 
 	buf->cursor_column = cc;
 }
 
 void buffer_move_backward_line(struct buffer *buf)
 {
-	int ll, cc;
+	int cc;
 
-	cc = buf->cursor_column;
+	cc = buffer_cursor_column(buf);
 
-	buffer_move_beginning_of_line(buf);
-	buffer_move_backward_char(buf);
-	buffer_move_beginning_of_line(buf);
-
-	ll = buffer_get_line_length(buf);
-	while (buffer_get_line_offset(buf) < cc
-	       && buffer_get_line_offset(buf) < ll)
-		buffer_move_forward_char(buf);
+	if (buf->cur_line > 0)
+		buf->cur_line--;
+	buf->cursor = buffer_column_find(buf, buffer_line_start(buf, buf->cur_line), cc);
+	buffer_selection_update(buf);
 
 	buf->cursor_column = cc;
 }
@@ -675,7 +1937,7 @@ void buffer_move_beginning_of_buffer(struct buffer *buf)
 void buffer_move_end_of_buffer(struct buffer *buf)
 {
 	buf->cursor = buf->used;
-	buf->cur_line = buf->last_line;
+	buf->cur_line = buffer_last_line(buf);
 	buffer_cursor_column_update(buf);
 	buffer_selection_update(buf);
 }
@@ -706,31 +1968,13 @@ void buffer_move_backward_bracket(struct buffer *buf)
 
 void buffer_goto_line(struct buffer *buf, int line)
 {
-	int p = 0, nl = 0, l = line, lastp;
-
-	if (line < 0)
-		return;
-
-	while (l >= 0) {
-		int tmp;
-
-		lastp = p;
-		p = buffer_find_char_next(buf, p, "\n", &tmp);
-		if (p < 0)
-			break;
-		else {
-			buf->cursor = p;
-			buf->cursor = buffer_get_line_beginning(buf);
-			buf->cur_line = nl;
-		}
-		l--;
-		nl++;
-		p++;
-	}
-	if (p < 0 && line != 0) {
-		buf->cursor = lastp;
-		buf->cur_line = buf->last_line;
-	}
+	if (line < 0)
+		return;
+
+	if (buffer_line_start(buf, line) < 0)
+		line = buffer_last_line(buf);
+	buf->cursor = buffer_line_start(buf, line);
+	buf->cur_line = line;
 
 	buffer_cursor_column_update(buf);
 	buffer_selection_update(buf);
@@ -745,22 +1989,28 @@ void buffer_insert_char(struct buffer *buf, const char c)
 
 void buffer_insert_string(struct buffer *buf, const char *str, size_t len)
 {
-	int nl;
-
 	if (!str || len <= 0)
 		return;
 
-	if (buf->used + len >= buf->size)
-		buffer_expand(buf, BUFFER_ALLOC_CHUNK);
-
-	buffer_adjust_gap(buf);
-	memcpy(buf->data + buf->gap_start, str, len);
-	nl = str_newlines(str, len);
-	buf->gap_start += len;
+	undo_record(buf, true, buf->cursor, str, len);
+	match_count_invalidate(buf);
+	column_cache_edit(buf, buf->cursor, 0, len);
+	wrap_map_edit(buf, buf->cursor, 0, str, len);
+	line_index_insert(buf, buf->cursor, str, len);
+	if (buf->storage == STORAGE_PIECE) {
+		piece_table_insert(buf->pieces, buf->cursor, str, len);
+	} else if (buf->storage == STORAGE_ROPE) {
+		rope_insert(buf->rope, buf->cursor, str, len);
+	} else {
+		buffer_reserve(buf, len);
+		buffer_adjust_gap(buf);
+		memcpy(buf->data + buf->gap_start, str, len);
+		buf->gap_start += len;
+	}
 	buf->used += len;
+	match_count_edit(buf, buf->cursor, 0, len);
 	buf->cursor += len;
-	buf->cur_line += nl;
-	buf->last_line += nl;
+	buf->cur_line = buffer_line_at(buf, buf->cursor);
 	buf->modified = true;
 	buffer_cursor_column_update(buf);
 }
@@ -802,45 +2052,62 @@ void buffer_delete_backward_word(struct buffer *buf, char **out, int *n_out)
 {
 }
 
-void buffer_delete_region(struct buffer *buf, int beg, int end, char **out, int *n_out)
+/* Order and clip the inclusive region [*beg, *end] to the text, return its
+   length or 0 if it is outside of the text. */
+static int buffer_clip_region(struct buffer *buf, int *beg, int *end)
 {
-	int n = end - beg + 1, from, nl, nl_to_cursor;
-
-	if (beg < 0 && end < 0 ||
-	    beg >= buf->used && end >= buf->used)
-		return;
+	if (*beg < 0 && *end < 0 ||
+	    *beg >= buf->used && *end >= buf->used)
+		return 0;
 
 	/* Right now, this can happen during text selection */
-	if (end < beg) {
-		int tmp = beg;
-		beg = end;
-		end = tmp;
+	if (*end < *beg) {
+		int tmp = *beg;
+		*beg = *end;
+		*end = tmp;
 	}
 
-	if (end >= buf->used)
-		end = buf->used - 1;
+	if (*end >= buf->used)
+		*end = buf->used - 1;
 
-	n = end - beg + 1;
-	nl = region_newlines(buf, beg, end);
-	nl_to_cursor = region_newlines(buf, beg, buf->cursor);
-	if (buffer_data_at(buf, buf->cursor) == '\n')
-		nl_to_cursor--;
-	buf->cursor = beg;
-	buffer_adjust_gap(buf);
-	from = buf->gap_end;
-	buf->gap_end += n;
-	buf->used -= n;
-	buf->cur_line -= nl_to_cursor;
-	buf->last_line -= nl;
-	buf->modified = true;
-	buffer_cursor_column_update(buf);
+	return *end - *beg + 1;
+}
+
+void buffer_delete_region(struct buffer *buf, int beg, int end, char **out, int *n_out)
+{
+	int n = buffer_clip_region(buf, &beg, &end);
 
+	if (n <= 0)
+		return;
 	if (out) {
 		*out = calloc(1, n);
 		if (!*out)
 			oom();
-		memcpy(*out, buf->data + from, n);
+		buffer_copy(buf, beg, n, *out);
+	}
+
+	undo_record(buf, false, beg, NULL, n);
+	match_count_invalidate(buf);
+	column_cache_edit(buf, beg, n, 0);
+	wrap_map_edit(buf, beg, n, NULL, 0);
+	line_index_delete(buf, beg, n);
+	buf->cursor = beg;
+	if (buf->storage == STORAGE_PIECE) {
+		piece_table_delete(buf->pieces, beg, n);
+	} else if (buf->storage == STORAGE_ROPE) {
+		rope_delete(buf->rope, beg, n);
+	} else {
+		buffer_adjust_gap(buf);
+		buf->gap_end += n;
 	}
+	buf->used -= n;
+	if (buf->storage == STORAGE_GAP)
+		buffer_shrink(buf);
+	match_count_edit(buf, beg, n, 0);
+	buf->cur_line = buffer_line_at(buf, beg);
+	buf->modified = true;
+	buffer_cursor_column_update(buf);
+
 	if (n_out)
 		*n_out = n;
 }
@@ -860,12 +2127,72 @@ void buffer_delete_selection(struct buffer *buf, char **out, int *n_out)
 
 void buffer_clear(struct buffer *buf)
 {
+	match_count_free(buf);
+	if (buf->pieces)
+		piece_table_clear(buf->pieces);
+	if (buf->rope)
+		rope_clear(buf->rope);
 	buf->used = 0;
 	buf->gap_start = 0;
 	buf->gap_end = buf->size;
+	if (buf->storage == STORAGE_GAP)
+		buffer_shrink(buf);
 	buf->cursor = 0;
 	buf->cur_line = 0;
-	buf->last_line = 0;
+	buf->cursor_column = 0;
+	line_index_reset(&buf->lines);
+	column_cache_reset_all(buf);
+	wrap_map_reset(&buf->wrap);
+	undo_log_clear(&buf->undo);
+}
+
+/* Undo the last edit still in effect. The text comes back from the log in
+ * one piece, however it was typed.
+ * Return false if there is nothing to undo.
+ */
+bool buffer_undo(struct buffer *buf)
+{
+	struct undo_log *ul = &buf->undo;
+	struct undo_op *op;
+
+	if (ul->done == 0)
+		return false;
+
+	op = &ul->ops[--ul->done];
+	ul->suspended = true;
+	if (op->insert) {
+		buffer_delete_region(buf, op->pos, op->pos + op->len - 1, NULL, NULL);
+	} else {
+		buffer_set_cursor(buf, op->pos);
+		buffer_insert_string(buf, ul->arena + (op->text - ul->base), op->len);
+	}
+	ul->suspended = false;
+
+	return true;
+}
+
+/* Make the last undone edit again.
+ * Return false if there is nothing to redo.
+ */
+bool buffer_redo(struct buffer *buf)
+{
+	struct undo_log *ul = &buf->undo;
+	struct undo_op *op;
+
+	if (ul->done == ul->len)
+		return false;
+
+	op = &ul->ops[ul->done++];
+	ul->suspended = true;
+	if (op->insert) {
+		buffer_set_cursor(buf, op->pos);
+		buffer_insert_string(buf, ul->arena + (op->text - ul->base), op->len);
+	} else {
+		buffer_delete_region(buf, op->pos, op->pos + op->len - 1, NULL, NULL);
+	}
+	ul->suspended = false;
+
+	return true;
 }
 
 void buffer_selection_toggle(struct buffer *buf)
@@ -886,23 +2213,13 @@ void buffer_selection_update(struct buffer *buf)
 /* TODO: searches work from cursor; add a helper search function to utils that is more general */
 int buffer_search_forward(struct buffer *buf, const char *str)
 {
-	char *text, *from, *s;
-	int p = -1;
+	int p, from = buf->cursor;
 
-	text = malloc(buf->used + 1);
-	assert(text);
-	memcpy(text, buf->data, buf->gap_start);
-	memcpy(text + buf->gap_start, buf->data + buf->gap_end, buf->size - buf->gap_end);
-	text[buf->used] = '\0';
-	from = text + buf->cursor;
-	s = strstr(from, str);
-	if (s) {
-		p = s - from;
-		buf->cursor += p;
-		buf->cur_line += str_newlines(from, p);
+	p = search_forward(buf, from, str, strlen(str));
+	if (p >= 0) {
+		buffer_set_cursor(buf, p);
+		p -= from;
 	}
-	free(text);
-	buffer_cursor_column_update(buf);
 	buffer_selection_update(buf);
 
 	return p;
@@ -910,37 +2227,11 @@ int buffer_search_forward(struct buffer *buf, const char *str)
 
 int buffer_search_backward(struct buffer *buf, const char *str)
 {
-	char *text, *s;
-	int p = 0;
-
-	text = malloc(buf->used + 1);
-	assert(text);
-	memcpy(text, buf->data, buf->gap_start);
-	memcpy(text + buf->gap_start, buf->data + buf->gap_end, buf->size - buf->gap_end);
-	text[buf->used] = '\0';
-
-	/* TODO: If the stars ever align correctly, this mess should be simplified... */
-	s = strstr(text, str);
-	if (s) {
-		while (1) {
-			int len;
+	int p;
 
-			s = strstr(text + p + 1, str);
-			if (s) {
-				len = s - (text + p);
-				if (p + len < buf->cursor)
-					p += len;
-				else
-					break;
-			} else {
-				break;
-			}
-		}
-		buf->cursor = p;
-		buf->cur_line = str_newlines(text, p);
-	}
-	free(text);
-	buffer_cursor_column_update(buf);
+	p = search_backward(buf, buf->cursor, str, strlen(str));
+	if (p >= 0)
+		buffer_set_cursor(buf, p);
 	buffer_selection_update(buf);
 
 	return p;
@@ -967,31 +2258,23 @@ bool is_position_in_region(int pos, int beg, int end)
  */
 int str_newlines(const char *str, int n)
 {
-	int l = 0, i = 0;
-
-	while (i < n) {
-		if (str[i] == '\n')
-			l++;
-		i++;
-	}
-
-	return l;
+	return newline_count(str, n);
 }
 
 /* Count newlines in a buffer region.
  * Input must be a valid buffer region. */
 int region_newlines(struct buffer *buf, int beg, int end)
 {
-	int nl = 0, p = beg, way;
-	char c;
+	struct span sp;
+	int p, nl = 0;
 
-	way = beg < end ? 1 : -1;
-	do {
-		c = buffer_data_at(buf, p);
-		if (is_utf8(c) && c == '\n')
-			nl++;
-		p += way;
-	} while (is_position_in_region(p, beg, end));
+	if (end < beg) {
+		int tmp = beg;
+		beg = end;
+		end = tmp;
+	}
+	for (p = beg; buffer_span_forward(buf, p, end + 1, &sp); p += sp.len)
+		nl += str_newlines(sp.data, sp.len);
 
 	return nl;
 }
@@ -1023,17 +2306,52 @@ static void editor_create_buffer(const char *path)
 	buf = buffer_new();
 	if (!buf)
 		oom();
+	buf->undo.max = editor.undo_max;
 	editor_add_buffer(buf);
 	editor.buf_current = buf;
 
-	if (path && buffer_load(buf, path) < 0)
+	if (path && buffer_load(buf, path, editor.storage) < 0)
 		die("Can't open '%s': %m", path);
 }
 
+static enum storage parse_storage(const char *name)
+{
+	if (strcmp(name, "gap") == 0)
+		return STORAGE_GAP;
+	if (strcmp(name, "piece") == 0)
+		return STORAGE_PIECE;
+	if (strcmp(name, "rope") == 0)
+		return STORAGE_ROPE;
+	die("Unknown storage '%s', use one of gap, piece or rope", name);
+	return STORAGE_GAP;
+}
+
+static enum output parse_output(const char *name)
+{
+	if (strcmp(name, "curses") == 0)
+		return OUTPUT_CURSES;
+	if (strcmp(name, "vt") == 0)
+		return OUTPUT_VT;
+	die("Unknown output '%s', use one of curses or vt", name);
+	return OUTPUT_CURSES;
+}
+
+static size_t parse_megabytes(const char *str)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(str, &end, 10);
+	if (errno || end == str || *end != '\0' || n < 0 || n > INT_MAX >> 20)
+		die("Invalid size '%s' in megabytes", str);
+	return (size_t)n << 20;
+}
+
 void editor_init(int argc, char *argv[])
 {
 	struct buffer *buf = NULL;
-	int i = 1;
+	int opt;
 
 	editor.buf_first = NULL;
 	editor.buf_last = NULL;
@@ -1041,25 +2359,77 @@ void editor_init(int argc, char *argv[])
 	editor.mode = M_COMMAND;
 	editor.screen_start = 0;
 	editor.screen_width = getmaxy(stdscr) - 3;
-	editor.clipboard_len = 0;
-	editor.clipboard = NULL;
+	editor.screen_left = 0;
+	editor.wrap = false;
+	editor.screen_row = 0;
+	editor.kills.first = 0;
+	editor.kills.count = 0;
+	editor.kills.store = NULL;
+	editor.kills.size = 0;
+	editor.undo_max = (size_t)UNDO_LOG_MAX_MB << 20;
+	editor.paste = NULL;
+	editor.paste_len = 0;
+	editor.paste_size = 0;
 	editor.cursor_last = 0;
 	editor.line_last = 0;
 	editor.key_last = 0;
+	editor.command_last = NULL;
 	editor.search_last = NULL;
 	editor.search_dir = SEARCH_FORWARD;
+	editor.search_hits = NULL;
+	editor.search_hits_len = 0;
+	editor.search_hits_size = 0;
+	editor.search_regex = false;
+	editor.search_re = NULL;
+	editor.search_marks = NULL;
+	editor.search_marks_len = 0;
+	editor.search_marks_size = 0;
+	editor.search_job = NULL;
+	editor.screen_rows = NULL;
+	editor.screen_rows_len = 0;
+	editor.screen_stale = true;
+	editor.screen_drawn_buf = NULL;
+	editor.screen_drawn_start = 0;
+	editor.screen_drawn_row = 0;
+	editor.output = OUTPUT_CURSES;
+	editor.storage = STORAGE_PIECE;
 	editor.keybindings = DEFAULT_KEYBINDINGS;
 
-	if (argc == 1)
+	/* -s STORAGE: how to keep large files, see BUFFER_LARGE_FILE. */
+	/* -o OUTPUT: draw the screen through curses or straight to the terminal. */
+	/* -w: wrap long lines instead of scrolling sideways. */
+	/* -u MB: memory for the undo log of every buffer. */
+	while ((opt = getopt(argc, argv, "s:o:wu:")) != -1) {
+		switch (opt) {
+		case 's':
+			editor.storage = parse_storage(optarg);
+			break;
+		case 'o':
+			editor.output = parse_output(optarg);
+			break;
+		case 'w':
+			editor.wrap = true;
+			break;
+		case 'u':
+			editor.undo_max = parse_megabytes(optarg);
+			break;
+		default:
+			die("Usage: %s [-s gap|piece|rope] [-o curses|vt] [-w] [-u MB] [FILE]...", argv[0]);
+		}
+	}
+
+	if (optind == argc)
 		editor_create_buffer(NULL);
 
-	while (i < argc)
-		editor_create_buffer(argv[i++]);
+	while (optind < argc)
+		editor_create_buffer(argv[optind++]);
 
 	/* Special-purpose minibuffer. Can't be accessed directly. */
 	buf = buffer_new();
 	if (!buf)
 		oom();
+	/* Nothing typed into the minibuffer is worth undoing. */
+	buf->undo.max = 0;
 	editor.minibuf.prompt = NULL;
 	editor.minibuf.buf = buf;
 	editor.minibuf.action_cb = NULL;
@@ -1116,10 +2486,11 @@ void editor_load_file(void)
 	buf = buffer_new();
 	if (!buf)
 		oom();
+	buf->undo.max = editor.undo_max;
 
-	if (buffer_load(buf, editor_dialog("Load file: ")) < 0) {
+	if (buffer_load(buf, editor_dialog("Load file: "), editor.storage) < 0) {
 		editor_error("Failed to load file");
-		free(buf); /* TODO: buffer_free() or something */
+		buffer_free(buf);
 	} else {
 		buffer_move_beginning_of_buffer(buf);
 		editor_add_buffer(buf);
@@ -1127,6 +2498,49 @@ void editor_load_file(void)
 	}
 }
 
+/* Dialogs with "-o vt" are drawn on the top row of the grid, as curses has
+ * never drawn the screen and would send the wrong bytes.
+ * Return the column after "text".
+ */
+static int vt_dialog_row(const char *prompt, int attr, const char *text, int len)
+{
+	int i, x = 0;
+
+	vt_move(0, 0);
+	vt_addnstr(prompt, strlen(prompt), attr);
+	vt_addnstr(text, len, CP_NORMAL_TEXT);
+	vt_clrtoeol();
+	for (i = 0; prompt[i]; i++)
+		x += is_utf8(prompt[i]);
+	for (i = 0; i < len; i++)
+		x += is_utf8(text[i]);
+
+	return min(x, COLS - 1);
+}
+
+/* Read a line of at most "n" - 1 bytes into "str" after "prompt". */
+static void vt_dialog(const char *prompt, char *str, int n)
+{
+	int c, len = 0;
+
+	wtimeout(input, -1);
+	for (;;) {
+		vt_cursor(0, vt_dialog_row(prompt, ATTR_BOLD, str, len));
+		vt_flush();
+		c = wgetch(input);
+		if (c == '\n' || c == '\r' || c == KEY_ENTER)
+			break;
+		if (c == KEY_BACKSPACE || c == 127 || c == CTRL('h')) {
+			/* Drop the whole of the last character. */
+			while (len > 0 && !is_utf8(str[--len]))
+				;
+		} else if (c >= ' ' && c <= 0xff && len < n - 1) {
+			str[len++] = c;
+		}
+	}
+	str[len] = '\0';
+}
+
 char *editor_dialog(const char *prompt)
 {
 	const int n = 1024;
@@ -1134,108 +2548,546 @@ char *editor_dialog(const char *prompt)
 
 	str = calloc(n, 1);
 	assert(str);
+	if (editor.output == OUTPUT_VT) {
+		vt_dialog(prompt, str, n);
+		editor_invalidate();
+		return str;
+	}
+	move(0, 0);
+	deleteln();
+	/* This insertln() call is needed when the dialog is shown at the top of the screen,
+	   because deleteln() actually moves all lines up by one. */
+	insertln();
+
+	echo();
+	attron(A_BOLD);
+	mvprintw(0, 0, prompt);
+	attroff(A_BOLD);
+	getnstr(str, n - 1);
+	noecho();
+	editor_invalidate();
+
+	return str;
+}
+
+void editor_error(const char *error)
+{
+	curs_set(0);
+	if (editor.output == OUTPUT_VT) {
+		vt_cursor(0, vt_dialog_row(error, CP_ERROR | ATTR_BOLD, "", 0));
+		vt_flush();
+		wtimeout(input, -1);
+		wgetch(input);
+		curs_set(1);
+		editor_invalidate();
+		return;
+	}
 	move(0, 0);
 	deleteln();
 	/* This insertln() call is needed when the dialog is shown at the top of the screen,
 	   because deleteln() actually moves all lines up by one. */
 	insertln();
 
-	echo();
-	attron(A_BOLD);
-	mvprintw(0, 0, prompt);
-	attroff(A_BOLD);
-	getnstr(str, n - 1);
-	noecho();
+	attron(COLOR_PAIR(CP_ERROR));
+	attron(A_BOLD);
+	printw(error);
+	attroff(A_BOLD);
+	attroff(COLOR_PAIR(CP_ERROR));
+	getch();
+	curs_set(1);
+	editor_invalidate();
+}
+
+static unsigned long long hash_bytes(unsigned long long h, const void *data, size_t n)
+{
+	const unsigned char *p = data;
+
+	while (n--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+	return h;
+}
+
+/* Make sure there is a row for every line of the terminal. */
+static void editor_screen_rows(void)
+{
+	if (editor.output == OUTPUT_VT)
+		vt_resize(LINES, COLS);
+	if (editor.screen_rows_len == LINES)
+		return;
+	editor.screen_rows = realloc(editor.screen_rows, LINES * sizeof(*editor.screen_rows));
+	if (!editor.screen_rows)
+		oom();
+	editor.screen_rows_len = LINES;
+	editor_invalidate();
+}
+
+/* Return true if "row" has to be drawn anew to show what hashes to "hash". */
+static bool editor_row_dirty(int row, unsigned long long hash)
+{
+	editor_screen_rows();
+	if (row >= editor.screen_rows_len)
+		return false;
+	if (!editor.screen_stale && editor.screen_rows[row] == hash)
+		return false;
+	editor.screen_rows[row] = hash;
+	return true;
+}
+
+/* Forget what is on the screen, so that every row is drawn again.
+ * Needed after anything but the redisplay draws on it.
+ */
+void editor_invalidate(void)
+{
+	editor.screen_stale = true;
+	if (editor.output == OUTPUT_VT)
+		vt_invalidate();
+}
+
+/* The screen is drawn through curses, or with "-o vt" straight to the
+ * terminal. Either way, rows are drawn whole, as bytes and how each of them
+ * is shown.
+ */
+static int curses_attr(int attr)
+{
+	return COLOR_PAIR(ATTR_PAIR(attr)) | ((attr & ATTR_BOLD) ? A_BOLD : 0);
+}
+
+/* Draw "n" bytes of "text" on "row" and clear the rest of it. Each run of
+ * bytes shown alike is drawn at once.
+ */
+static void screen_draw_row(int row, const char *text, const int *attrs, int n)
+{
+	int i, j;
+
+	if (editor.output == OUTPUT_VT)
+		vt_move(row, 0);
+	else
+		move(row, 0);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && attrs[j] == attrs[i]; j++)
+			;
+		if (editor.output == OUTPUT_VT) {
+			vt_addnstr(text + i, j - i, attrs[i]);
+		} else {
+			attrset(curses_attr(attrs[i]));
+			addnstr(text + i, j - i);
+		}
+	}
+	if (editor.output == OUTPUT_VT) {
+		vt_clrtoeol();
+		return;
+	}
+	attrset(A_NORMAL);
+	/* A full row leaves the cursor on the next one. */
+	if (getcury(stdscr) == row)
+		clrtoeol();
+}
+
+/* Scroll rows "top" to "bottom" by "n" rows, up if positive. */
+static void screen_scroll(int top, int bottom, int n)
+{
+	if (editor.output == OUTPUT_VT) {
+		vt_scroll(top, bottom, n);
+		return;
+	}
+	setscrreg(top, bottom);
+	scrollok(stdscr, TRUE);
+	wscrl(stdscr, n);
+	scrollok(stdscr, FALSE);
+	setscrreg(0, LINES - 1);
+}
+
+static void screen_cursor(int y, int x)
+{
+	if (editor.output == OUTPUT_VT)
+		vt_cursor(y, x);
+	else
+		move(y, x);
+}
+
+/* Show what has been drawn. */
+static void screen_flush(void)
+{
+	if (editor.output == OUTPUT_VT)
+		vt_flush();
+	else
+		refresh();
+}
+
+/* Append "s" to a row of "n" bytes out of "size", shown as "attr".
+ * Return the new length of the row.
+ */
+static int row_add(char *text, int *attrs, int n, int size, const char *s, int attr)
+{
+	for (; *s && n < size; s++, n++) {
+		text[n] = *s;
+		attrs[n] = attr;
+	}
+
+	return n;
+}
+
+static unsigned long long row_hash(const char *text, const int *attrs, int n)
+{
+	return hash_bytes(hash_bytes(HASH_INIT, text, n), attrs, n * sizeof(int));
+}
+
+void editor_show_status_line(void)
+{
+	struct buffer *buf = editor.buf_current;
+	const char *mode;
+	const char *modified = (buf->modified) ? "[+]" : "";
+	int pair = CP_NORMAL_TEXT, size, n, i, cols, y, x;
+	int *attrs;
+	char *text, *left;
+
+	if (editor.mode == M_COMMAND) {
+		mode = "[C]";
+		pair = CP_MODE_COMMAND;
+	} else if (editor.mode == M_EDITING) {
+		mode = "[E]";
+		pair = CP_MODE_EDITING;
+	} else if (editor.mode == M_SELECTION) {
+		mode = "[S]";
+		pair = CP_MODE_SELECTION;
+	} else {
+		mode = "[M]";
+	}
+
+	buffer_get_yx(buf, &y, &x);
+
+	char *s, *count;
+	int total, nth;
+	if (!buf->matches) {
+		count = strdup("");
+	} else if (!match_count_get(buf, buf->cursor, &total, &nth)) {
+		count = total ? NULL : strdup("");
+		if (total && asprintf(&count, "%'d+ matches  ", total) < 0)
+			count = NULL;
+	} else if (nth) {
+		if (asprintf(&count, "match %'d of %'d  ", nth, total) < 0)
+			count = NULL;
+	} else if (asprintf(&count, "%'d match%s  ", total, (total == 1) ? "" : "es") < 0) {
+		count = NULL;
+	}
+	if (!count)
+		oom();
+	if (asprintf(&s, "%s%d:%d (%d)", count, x, y, buf->used) < 0)
+		oom();
+	free(count);
+	if (asprintf(&left, " %s %s", buf->name, modified) < 0)
+		oom();
+
+	size = COLS * 4;
+	text = malloc(size);
+	attrs = malloc(size * sizeof(int));
+	if (!text || !attrs)
+		oom();
+	n = row_add(text, attrs, 0, size, mode, pair | ATTR_BOLD);
+	n = row_add(text, attrs, n, size, left, ATTR_BOLD);
+	for (i = 0, cols = 0; i < n; i++)
+		cols += is_utf8(text[i]);
+	for (; cols < COLS - (int)strlen(s); cols++)
+		n = row_add(text, attrs, n, size, " ", ATTR_BOLD);
+	n = row_add(text, attrs, n, size, s, ATTR_BOLD);
+	if (editor_row_dirty(1, row_hash(text, attrs, n)))
+		screen_draw_row(1, text, attrs, n);
+
+	free(text);
+	free(attrs);
+	free(left);
+	free(s);
+}
+
+/* Count the matches of the last search in the current buffer, once it is
+ * no longer being typed.
+ */
+static void editor_update_match_count(void)
+{
+	struct buffer *buf = editor.buf_current;
+	struct match_count *mc = buf->matches;
+	const char *str = editor.search_last;
+
+	if (mc && (!str || strcmp(mc->str, str) || (mc->re != NULL) != editor.search_regex))
+		match_count_free(buf);
+	if (buf->matches || !str || !*str || editor.mode & M_MINIBUFFER)
+		return;
+	if (editor.search_regex && !editor.search_re)
+		return;
+	match_count_new(buf, str, strlen(str), editor.search_regex);
+}
+
+/* Long lines are wrapped at a multiple of TAB_STOP columns, so that tabs
+ * line up the same on every row.
+ */
+static int editor_wrap_width(void)
+{
+	return max(TAB_STOP, COLS - COLS % TAB_STOP);
+}
+
+/* Return the number of screen rows "line" takes, but at most "limit". */
+static int editor_line_rows(struct buffer *buf, int line, int limit)
+{
+	if (!editor.wrap)
+		return 1;
+
+	return buffer_line_rows(buf, line, editor_wrap_width(), limit);
+}
+
+/* Return the row of its line the cursor is on. */
+static int editor_cursor_row(struct buffer *buf)
+{
+	if (!editor.wrap)
+		return 0;
+
+	return buffer_get_line_offset(buf) / editor_wrap_width();
+}
+
+/* Count the screen rows from row "row" of "line" down to row "row2" of
+ * "line2", but at most "limit", which is also returned if the second row
+ * is above the first.
+ */
+static int editor_rows_between(struct buffer *buf, int line, int row, int line2, int row2, int limit)
+{
+	int n = -row;
+
+	if (line2 < line || (line2 == line && row2 < row))
+		return limit;
+	for (; line < line2 && n < limit; line++)
+		n += editor_line_rows(buf, line, limit - n);
+
+	return min(n + row2, limit);
+}
+
+/* Move up by "n" screen rows from row "row" of "line". Lines moved into
+ * from below have to be measured in full, to know their last row.
+ */
+static void editor_rows_back(struct buffer *buf, int *line, int *row, int n)
+{
+	int k;
+
+	while (n > 0) {
+		if (*row > 0) {
+			k = min(*row, n);
+			*row -= k;
+			n -= k;
+		} else if (*line > 0) {
+			(*line)--;
+			*row = editor_line_rows(buf, *line, INT_MAX) - 1;
+			n--;
+		} else {
+			break;
+		}
+	}
+}
+
+void editor_update_screen(void)
+{
+	struct buffer *buf = editor.buf_current;
+	int height = editor.screen_width;
+	int cl = buf->cur_line;
+	int cr = editor_cursor_row(buf);
+	int x;
+
+	/* An edit may have made the first line shorter. */
+	editor.screen_row = min(editor.screen_row,
+				editor_line_rows(buf, editor.screen_start, editor.screen_row + 1) - 1);
+
+	if (cl < editor.screen_start || (cl == editor.screen_start && cr < editor.screen_row)) {
+		editor.screen_start = cl;
+		editor.screen_row = cr;
+	} else if (editor_rows_between(buf, editor.screen_start, editor.screen_row,
+				       cl, cr, height) >= height) {
+		editor.screen_start = cl;
+		editor.screen_row = cr;
+		editor_rows_back(buf, &editor.screen_start, &editor.screen_row, height - 1);
+	}
+
+	if (editor.wrap) {
+		editor.screen_left = 0;
+		return;
+	}
 
-	return str;
+	/* Scroll sideways by half a screen, so that moving along a long line
+	   does not redraw every row for every column. */
+	x = buffer_get_line_offset(buf);
+	if (x < editor.screen_left || x >= editor.screen_left + COLS) {
+		editor.screen_left = max(0, x - COLS / 2);
+		editor.screen_left -= editor.screen_left % TAB_STOP;
+	}
 }
 
-void editor_error(const char *error)
+static void editor_add_mark(int beg, int end)
 {
-	curs_set(0);
-	move(0, 0);
-	deleteln();
-	/* This insertln() call is needed when the dialog is shown at the top of the screen,
-	   because deleteln() actually moves all lines up by one. */
-	insertln();
-
-	attron(COLOR_PAIR(CP_ERROR));
-	attron(A_BOLD);
-	printw(error);
-	attroff(A_BOLD);
-	attroff(COLOR_PAIR(CP_ERROR));
-	getch();
-	curs_set(1);
+	if (editor.search_marks_len + 2 > editor.search_marks_size) {
+		editor.search_marks_size = max(16, editor.search_marks_size * 2);
+		editor.search_marks = realloc(editor.search_marks, editor.search_marks_size * sizeof(int));
+		if (!editor.search_marks)
+			oom();
+	}
+	editor.search_marks[editor.search_marks_len++] = beg;
+	editor.search_marks[editor.search_marks_len++] = end;
 }
 
-void editor_show_status_line(void)
+/* Find the matches of the last search that show between "beg" and "end".
+ * Only that text is searched, plus as much before and after it as a literal
+ * match can stick out, so highlighting costs the same anywhere in a buffer.
+ * A regex match can be any length: it is looked for in SEARCH_MARK_CONTEXT
+ * bytes around the row and no further, and cut at the end of the row.
+ */
+static void editor_find_marks(struct buffer *buf, int beg, int end)
 {
-	struct buffer *buf = editor.buf_current;
-	const char *mode;
-	const char *modified = (buf->modified) ? "[+]" : "";
-	int y, x;
+	struct search_pattern pat;
+	int len, p, s, e, stop;
 
-	if (editor.mode == M_COMMAND) {
-		mode = "[C]";
-		attron(COLOR_PAIR(CP_MODE_COMMAND));
-	} else if (editor.mode == M_EDITING) {
-		mode = "[E]";
-		attron(COLOR_PAIR(CP_MODE_EDITING));
-	} else if (editor.mode == M_SELECTION) {
-		attron(COLOR_PAIR(CP_MODE_SELECTION));
-		mode = "[S]";
+	editor.search_marks_len = 0;
+	if (!editor.search_last || !*editor.search_last)
+		return;
+	if (editor.search_regex && !editor.search_re)
+		return;
+
+	len = strlen(editor.search_last);
+	if (editor.search_regex) {
+		p = max(0, beg - SEARCH_MARK_CONTEXT);
+		stop = end + 1 + SEARCH_MARK_CONTEXT;
 	} else {
-		mode = "[M]";
+		search_init(&pat, editor.search_last, len);
+		p = max(0, beg - len + 1);
+		stop = end + len;
 	}
+	for (; ; p = (e > s) ? e : s + 1) {
+		if (editor.search_regex) {
+			s = regex_search_bounded(editor.search_re, buf, p, end + 1, stop, &e);
+		} else {
+			s = search_range(buf, &pat, p, stop);
+			e = s + len;
+		}
+		if (s < 0)
+			break;
+		if (e > beg)
+			editor_add_mark(s, min(e, end + 1));
+	}
+}
 
-	move(1, 0);
-
-	buffer_get_yx(buf, &y, &x);
-	attron(A_BOLD);
-	printw(mode);
-	attroff(COLOR_PAIR(CP_MODE_SELECTION));
-	attroff(COLOR_PAIR(CP_MODE_EDITING));
-	attroff(COLOR_PAIR(CP_MODE_COMMAND));
-	printw(" %s %s", buf->name, modified);
-
-	char *s;
-	if (asprintf(&s, "%d:%d (%d)", x, y, buf->used) < 0)
-		oom();
-	move(1, getmaxx(stdscr) - strlen(s));
-	printw(s);
-	free(s);
-	attroff(A_BOLD);
+/* If the text has only moved up or down since it was last drawn, scroll the
+ * rows it is on instead, so that just the rows scrolled into view are drawn.
+ * The terminal does the scrolling with a scroll region or by deleting and
+ * inserting lines.
+ */
+static void editor_scroll_rows(struct buffer *buf)
+{
+	unsigned long long *rows = editor.screen_rows + 2;
+	int height = editor.screen_width;
+	int n, i;
+
+	if (buf != editor.screen_drawn_buf || editor.screen_stale
+	    || height + 2 > editor.screen_rows_len)
+		goto out;
+
+	n = editor_rows_between(buf, editor.screen_drawn_start, editor.screen_drawn_row,
+				editor.screen_start, editor.screen_row, height);
+	if (n == height)
+		n = -editor_rows_between(buf, editor.screen_start, editor.screen_row,
+					 editor.screen_drawn_start, editor.screen_drawn_row, height);
+	if (n == 0 || abs(n) >= height)
+		goto out;
+
+	screen_scroll(2, height + 1, n);
+
+	/* The hashes move along with the rows, the rows scrolled into view
+	   are blank. */
+	if (n > 0) {
+		memmove(rows, rows + n, (height - n) * sizeof(*rows));
+		for (i = height - n; i < height; i++)
+			rows[i] = 0;
+	} else {
+		memmove(rows - n, rows, (height + n) * sizeof(*rows));
+		for (i = 0; i < -n; i++)
+			rows[i] = 0;
+	}
+out:
+	editor.screen_drawn_buf = buf;
+	editor.screen_drawn_start = editor.screen_start;
+	editor.screen_drawn_row = editor.screen_row;
 }
 
-void editor_update_screen(void)
+/* Lay out the line from "pos" on for a row of the screen "width" columns
+ * wide: the bytes that fit into "text", at most "size" of them, and how each
+ * is shown in "attrs". "m" is the first search mark that may still show.
+ * "last" is set if the line ends on this row, the way buffer_line_rows()
+ * counts rows. Return the number of bytes.
+ */
+static int editor_layout_row(struct buffer *buf, int pos, int sel_start, int sel_end, int *m,
+			     char *text, int *attrs, int size, int width, bool *last)
 {
-	int cl = editor.buf_current->cur_line;
-	int endl = editor.screen_start + editor.screen_width;
+	struct span sp;
+	int p, i, w, n = 0, cols = 0;
+
+	*last = false;
+	for (p = pos; buffer_span_forward(buf, p, buf->used, &sp); p += sp.len) {
+		for (i = 0; i < sp.len; i++) {
+			bool is_sel = buf->sel_active && is_position_in_region(sp.pos + i, sel_start, sel_end);
+			char c = sp.data[i];
+			int a = 0;
+
+			if (c == '\n') {
+				*last = cols < width;
+				return n;
+			}
+			w = (c == '\t') ? TAB_STOP - cols % TAB_STOP : is_utf8(c);
+			if (cols + w > width || n == size)
+				return n;
+
+			while (*m < editor.search_marks_len && editor.search_marks[*m + 1] <= sp.pos + i)
+				*m += 2;
+			if (is_sel)
+				a |= CP_HIGHLIGHT_SELECTION;
+			else if (*m < editor.search_marks_len && editor.search_marks[*m] <= sp.pos + i)
+				a |= CP_HIGHLIGHT_SEARCH;
+			if (c == '\t')
+				a |= ATTR_BOLD;
+			text[n] = c;
+			attrs[n] = a;
+			n++;
+			cols += w;
+		}
+	}
+	*last = cols < width;
 
-	if (cl >= endl)
-		editor.screen_start += cl - endl + 1;
-	else if (cl < editor.screen_start)
-		editor.screen_start -= editor.screen_start - cl;
+	return n;
 }
 
+/* Draw the rows of the screen that changed since the last time.
+ * A row is redrawn when its text or how the text is shown differs, which
+ * covers edits, scrolling, selection and search highlighting alike.
+ */
 void editor_redisplay(void)
 {
 	struct buffer *buf = editor.buf_current;
-	int sel_start, sel_end, display_start, display_end, pos;
+	int sel_start, sel_end, row, line, r, pos, size, width, n, m;
+	bool last;
+	int *attrs;
+	char *text;
 	int y, x;
-	char c;
 
+	/* A UTF-8 character takes up to 4 bytes, a tab up to TAB_STOP columns. */
+	size = COLS * 4;
+	text = malloc(size);
+	attrs = malloc(size * sizeof(int));
+	if (!text || !attrs)
+		oom();
+
+	n = 0;
 	if (editor.mode & M_MINIBUFFER) {
-		char *text;
+		char *content;
 
-		text = buffer_get_content(editor.minibuf.buf);
-		move(0, 0);
-		attron(A_BOLD);
-		printw(editor.minibuf.prompt);
-		attroff(A_BOLD);
-		printw(text);
-		free(text);
+		content = buffer_get_content(editor.minibuf.buf);
+		n = row_add(text, attrs, n, size, editor.minibuf.prompt, ATTR_BOLD);
+		n = row_add(text, attrs, n, size, content, CP_NORMAL_TEXT);
+		free(content);
 	}
+	if (editor_row_dirty(0, row_hash(text, attrs, n)))
+		screen_draw_row(0, text, attrs, n);
 
 	/* TODO: During selection, this should be automatically handled */
 	if (buf->sel_active && buf->sel_start < buf->sel_end) {
@@ -1246,31 +3098,45 @@ void editor_redisplay(void)
 		sel_end = buf->sel_start;
 	}
 
-	move(2, 0);
-
-	buffer_get_region(buf, editor.screen_start, editor.screen_width, &display_start, &display_end);
-
-	for (pos = display_start; pos <= display_end; pos++) {
-		bool is_tab = false;
-
-		c = buffer_data_at(buf, pos);
-
-		if (buf->sel_active && pos >= sel_start && pos <= sel_end)
-			attron(COLOR_PAIR(CP_HIGHLIGHT_SELECTION));
-		if (c == '\t') {
-			attron(A_BOLD);
-			is_tab = true;
+	editor_scroll_rows(buf);
+	width = editor.wrap ? editor_wrap_width() : COLS;
+	line = editor.screen_start;
+	r = editor.screen_row;
+	for (row = 0; row < editor.screen_width; row++) {
+		pos = buffer_line_start(buf, line);
+		/* Only the part of the line in view is laid out, however long
+		   the line is. */
+		n = 0;
+		if (pos >= 0) {
+			if (editor.wrap && r > 0)
+				pos = buffer_column_find(buf, pos, r * width);
+			else if (editor.screen_left > 0)
+				pos = buffer_column_find(buf, pos, editor.screen_left);
+			editor_find_marks(buf, pos, pos + size - 1);
+			m = 0;
+			n = editor_layout_row(buf, pos, sel_start, sel_end, &m, text, attrs, size,
+					      width, &last);
+			/* Where the row ends tells whether the line goes on, so
+			   the lines shown are not measured in full. */
+			r++;
+			if (!editor.wrap || last) {
+				line++;
+				r = 0;
+			}
 		}
-		printw("%c", c);
-		if (is_tab)
-			attroff(A_BOLD);
-		if (buf->sel_active && pos >= sel_start && pos <= sel_end)
-			attroff(COLOR_PAIR(CP_HIGHLIGHT_SELECTION));
+		if (editor_row_dirty(row + 2, row_hash(text, attrs, n)))
+			screen_draw_row(row + 2, text, attrs, n);
 	}
+	free(text);
+	free(attrs);
+	editor.screen_stale = false;
 
 	buffer_get_yx(buf, &y, &x);
-	y -= editor.screen_start;
-	move(y + 2, x);
+	r = editor_cursor_row(buf);
+	y = editor_rows_between(buf, editor.screen_start, editor.screen_row, y, r,
+				editor.screen_width);
+	x -= editor.wrap ? r * width : editor.screen_left;
+	screen_cursor(y + 2, min(x, COLS - 1));
 }
 
 int editor_process_key(int key)
@@ -1283,7 +3149,11 @@ int editor_process_key(int key)
 		if ((editor.keybindings[i].key == key || editor.keybindings[i].key == KEY_ANY)
 		    && editor.keybindings[i].modemask & editor.mode)
 		{
-			return editor.keybindings[i].command();
+			int (*command)(void) = editor.keybindings[i].command;
+			int ret = command();
+
+			editor.command_last = command;
+			return ret;
 		}
 		i++;
 	}
@@ -1291,6 +3161,89 @@ int editor_process_key(int key)
 	return 0;
 }
 
+/* Drop the oldest kill. */
+static void kill_ring_drop(struct kill_ring *kr)
+{
+	kr->first = (kr->first + 1) % KILL_RING_ENTRIES;
+	kr->count--;
+}
+
+static struct kill *kill_ring_last(struct kill_ring *kr)
+{
+	if (kr->count == 0)
+		return NULL;
+	return &kr->entries[(kr->first + kr->count - 1) % KILL_RING_ENTRIES];
+}
+
+/* Make room in the store for "n" bytes at "from", the end of the newest
+   kill, or at the beginning if they do not fit there. The kills in the way
+   are the oldest ones; "keep" is the newest and is left alone. */
+static size_t kill_ring_room(struct kill_ring *kr, size_t from, size_t n, struct kill *keep)
+{
+	size_t start = from + n <= kr->size ? from : 0;
+	struct kill *k;
+
+	while (kr->count > 0) {
+		k = &kr->entries[kr->first];
+		if (k == keep)
+			break;
+		/* Going back to the beginning skips the kills left after "from",
+		   and they are older than any kill before it. */
+		if (!(k->start < start + n && start < k->start + k->len) &&
+		    !(start < from && k->start >= from))
+			break;
+		kill_ring_drop(kr);
+	}
+	return start;
+}
+
+static void kill_ring_grow(struct kill_ring *kr, size_t n)
+{
+	size_t size = kr->size ? kr->size : KILL_RING_SIZE;
+
+	while (size < n)
+		size *= 2;
+	if (size == kr->size)
+		return;
+	kr->store = realloc(kr->store, size);
+	if (!kr->store)
+		oom();
+	kr->size = size;
+}
+
+/* Return where to copy "n" more bytes of deleted text, a new kill or the
+   end of the newest one when "append". */
+static char *kill_ring_push(struct kill_ring *kr, size_t n, bool append)
+{
+	struct kill *k = kill_ring_last(kr);
+	size_t start, len;
+
+	if (!append || !k) {
+		kill_ring_grow(kr, n);
+		start = kill_ring_room(kr, k ? k->start + k->len : 0, n, NULL);
+		if (kr->count == KILL_RING_ENTRIES)
+			kill_ring_drop(kr);
+		k = &kr->entries[(kr->first + kr->count) % KILL_RING_ENTRIES];
+		kr->count++;
+		k->start = start;
+		k->len = n;
+		return kr->store + start;
+	}
+
+	len = k->len + n;
+	kill_ring_grow(kr, len);
+	if (k->start + len <= kr->size) {
+		kill_ring_room(kr, k->start + k->len, n, k);
+	} else {
+		kill_ring_room(kr, k->start + k->len, len, k);
+		memmove(kr->store, kr->store + k->start, k->len);
+		k->start = 0;
+	}
+	start = k->start + k->len;
+	k->len = len;
+	return kr->store + start;
+}
+
 /* commands */
 
 int command_move_forward_char(void)
@@ -1341,22 +3294,27 @@ int command_move_end_of_line(void)
 	return 0;
 }
 
+/* Move by as many lines as take up a screen. */
 int command_move_page_up(void)
 {
-	int i;
+	struct buffer *buf = editor.buf_current;
+	int n;
 
-	for (i = 0; i < editor.screen_width; i++)
-		buffer_move_backward_line(editor.buf_current);
+	for (n = 0; n < editor.screen_width;
+	     n += editor_line_rows(buf, buf->cur_line, editor.screen_width - n))
+		buffer_move_backward_line(buf);
 
 	return 0;
 }
 
 int command_move_page_down(void)
 {
-	int i;
+	struct buffer *buf = editor.buf_current;
+	int n;
 
-	for (i = 0; i < editor.screen_width; i++)
-		buffer_move_forward_line(editor.buf_current);
+	for (n = 0; n < editor.screen_width;
+	     n += editor_line_rows(buf, buf->cur_line, editor.screen_width - n))
+		buffer_move_forward_line(buf);
 
 	return 0;
 }
@@ -1499,25 +3457,73 @@ int command_delete_backward_word(void)
 	return 0;
 }
 
+/* Delete the selection or the current line into the kill ring. Deleting
+   again right after adds to the same kill. */
 int command_delete_selection_or_line(void)
 {
-	if (editor.buf_current->sel_active)
-		buffer_delete_selection(editor.buf_current, &editor.clipboard, &editor.clipboard_len);
-	else
-		buffer_delete_line(editor.buf_current, &editor.clipboard, &editor.clipboard_len);
+	struct buffer *buf = editor.buf_current;
+	int beg, end, n;
+
+	if (buf->sel_active) {
+		beg = buf->sel_start;
+		end = buf->sel_end;
+		buf->sel_active = false;
+	} else {
+		beg = buffer_get_line_beginning(buf);
+		end = buffer_get_line_end(buf);
+	}
+	n = buffer_clip_region(buf, &beg, &end);
+	if (n > 0) {
+		buffer_copy(buf, beg, n, kill_ring_push(&editor.kills, n,
+			editor.command_last == command_delete_selection_or_line));
+		buffer_delete_region(buf, beg, end, NULL, NULL);
+	}
 	editor.mode = M_COMMAND;
 	return 0;
 }
 
+/* Delete all the text, in a way that can be undone. */
 int command_clear(void)
 {
-	buffer_clear(editor.buf_current);
+	struct buffer *buf = editor.buf_current;
+
+	if (buf->used > 0)
+		buffer_delete_region(buf, 0, buf->used - 1, NULL, NULL);
 	return 0;
 }
 
 int command_paste(void)
 {
-	buffer_insert_string(editor.buf_current, editor.clipboard, editor.clipboard_len);
+	struct kill *k = kill_ring_last(&editor.kills);
+
+	if (k)
+		buffer_insert_string(editor.buf_current, editor.kills.store + k->start, k->len);
+	return 0;
+}
+
+int command_undo(void)
+{
+	buffer_undo(editor.buf_current);
+	return 0;
+}
+
+int command_redo(void)
+{
+	buffer_redo(editor.buf_current);
+	return 0;
+}
+
+/* Insert pasted text as it is, whatever mode the editor is in. */
+int command_insert_paste(void)
+{
+	buffer_insert_string(editor.buf_current, editor.paste, editor.paste_len);
+	return 0;
+}
+
+/* Do nothing, for keys such as the end marker of a paste that came
+   without its start. */
+int command_ignore(void)
+{
 	return 0;
 }
 
@@ -1531,46 +3537,246 @@ int command_toggle_selection_mode(void)
 	return 0;
 }
 
+/* An incremental search in a large buffer, run in the background on a view
+ * of the buffer. It starts once typing pauses and is cancelled by the next
+ * key, so the only one there is always searches for the pattern as typed.
+ */
+struct search_job {
+	pthread_t thread;
+	bool started;
+	/* When to start, in milliseconds of the monotonic clock. */
+	long long due;
+	struct buffer *view;
+	char *str;
+	int len;
+	int from;
+	bool forward;
+	/* A regex search matches with a copy of its own, the DFA cache
+	   changes while matching. */
+	struct regex *re;
+	int cancel;
+	int done;
+	int result;
+};
+
+static void *search_job_run(void *data)
+{
+	struct search_job *job = data;
+	int end;
+
+	if (job->re && job->forward)
+		job->result = regex_search_forward(job->re, job->view, job->from, &end);
+	else if (job->re)
+		job->result = regex_search_backward(job->re, job->view, job->from, &end);
+	else if (job->forward)
+		job->result = search_forward(job->view, job->from, job->str, job->len);
+	else
+		job->result = search_backward(job->view, job->from, job->str, job->len);
+	__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/* Queue a search for "len" bytes of "str" from "from", for "re" if not NULL. */
+static void search_job_new(const char *str, int len, int from, struct regex *re)
+{
+	struct search_job *job;
+
+	job = calloc(1, sizeof(struct search_job));
+	if (!job)
+		oom();
+	job->str = malloc(len);
+	if (!job->str)
+		oom();
+	memcpy(job->str, str, len);
+	job->len = len;
+	job->from = from;
+	job->forward = editor.search_dir == SEARCH_FORWARD;
+	job->re = re;
+	job->due = clock_ms() + SEARCH_DEBOUNCE_MS;
+	editor.search_job = job;
+}
+
+static void search_job_start(struct search_job *job)
+{
+	job->view = parallel_view_new(editor.buf_current, &job->cancel);
+	/* Without a thread, just search right away. */
+	job->started = pthread_create(&job->thread, NULL, search_job_run, job) == 0;
+	if (!job->started)
+		search_job_run(job);
+}
+
+/* Cancel the search in the background, if any, and forget about it. */
+static void search_job_stop(void)
+{
+	struct search_job *job = editor.search_job;
+
+	if (!job)
+		return;
+	__atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+	if (job->started)
+		pthread_join(job->thread, NULL);
+	if (job->view)
+		parallel_view_free(job->view);
+	if (job->re)
+		regex_free(job->re);
+	free(job->str);
+	free(job);
+	editor.search_job = NULL;
+}
+
+/* Move to the match found by the finished search in the background. */
+static void search_job_finish(void)
+{
+	struct search_job *job = editor.search_job;
+	int p = job->result;
+
+	/* A literal search one byte longer than the known prefixes extends them. */
+	if (!job->re && editor.search_hits_len == job->len - 1) {
+		editor.search_hits[job->len - 1] = p;
+		editor.search_hits_len = job->len;
+	}
+	search_job_stop();
+	if (p >= 0)
+		buffer_set_cursor(editor.buf_current, p);
+	command_recenter();
+}
+
+/* Start the search in the background when it is due, or finish it when it
+ * is done. Return true if the cursor was moved to its result.
+ */
+static bool search_job_poll(void)
+{
+	struct search_job *job = editor.search_job;
+
+	if (!job)
+		return false;
+	if (!job->view) {
+		if (clock_ms() < job->due)
+			return false;
+		search_job_start(job);
+	}
+	if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+		return false;
+	search_job_finish();
+	return true;
+}
+
+/* Wait for the search in the background, if any, and move to its result. */
+static void search_job_wait(void)
+{
+	struct search_job *job = editor.search_job;
+
+	if (!job)
+		return;
+	if (!job->view)
+		search_job_start(job);
+	if (job->started)
+		pthread_join(job->thread, NULL);
+	job->started = false;
+	search_job_finish();
+}
+
 static void search_action(void)
 {
+	search_job_wait();
 	editor.mode = M_COMMAND;
 }
-static void search_update_common(char *str)
+/* Find the match for pattern "str" of length "len" while it is being typed.
+ * Every match of a pattern is also a match of its prefixes, so a longer
+ * pattern is searched for from where its prefix matched, and a prefix that
+ * didn't match rules out every longer pattern. Results for all prefixes are
+ * kept, so deleting characters goes back to them without searching.
+ * In a large buffer, the rest of the pattern is searched for in the
+ * background from the last known match on.
+ * Return the match position or -1.
+ */
+static int search_incremental(const char *str, int len)
 {
-	int p, nl;
+	struct buffer *buf = editor.buf_current;
+	const char *last = editor.search_last;
+	int known = 0, n, prev, from;
+
+	if (last) {
+		while (known < editor.search_hits_len && known < len && last[known] == str[known])
+			known++;
+	}
+	if (len > editor.search_hits_size) {
+		editor.search_hits_size = max(len, editor.search_hits_size * 2);
+		editor.search_hits = realloc(editor.search_hits, editor.search_hits_size * sizeof(int));
+		if (!editor.search_hits)
+			oom();
+	}
 
-	if (editor.search_dir == SEARCH_FORWARD) {
-		p = buffer_find_str_next(editor.buf_current,
-					 editor.cursor_last,
-					 str,
-					 &nl);
-		if (p >= 0) {
-			editor.buf_current->cursor = editor.cursor_last + p;
-			editor.buf_current->cur_line = editor.line_last + nl;
+	for (n = known + 1; n <= len; n++) {
+		prev = (n > 1) ? editor.search_hits[n - 2] : -1;
+		if (n > 1 && prev < 0) {
+			editor.search_hits[n - 1] = -1;
+			continue;
 		}
-	} else {
-		p = buffer_find_str_prev(editor.buf_current,
-					 editor.cursor_last,
-					 str,
-					 &nl);
-		if (p >= 0) {
-			editor.buf_current->cursor = p;
-			editor.buf_current->cur_line = nl;
+		if (editor.search_dir == SEARCH_FORWARD)
+			from = (n > 1) ? prev : editor.cursor_last;
+		else
+			from = (n > 1) ? prev + 1 : editor.cursor_last;
+		if (buf->used >= SEARCH_BACKGROUND_MIN) {
+			editor.search_hits_len = n - 1;
+			search_job_new(str, len, from, NULL);
+			return -1;
 		}
+		if (editor.search_dir == SEARCH_FORWARD)
+			editor.search_hits[n - 1] = search_forward(buf, from, str, n);
+		else
+			editor.search_hits[n - 1] = search_backward(buf, from, str, n);
+	}
+	editor.search_hits_len = len;
+
+	return editor.search_hits[len - 1];
+}
+/* Compile regex "str" of length "len" and find its match from where the search began.
+ * An invalid pattern is kept in "search_last" as typed, but doesn't match.
+ * In a large buffer, the match is searched for in the background.
+ * Return the match position or -1.
+ */
+static int search_regex(const char *str, int len)
+{
+	struct buffer *buf = editor.buf_current;
+	const char *error;
+	int end;
+
+	if (editor.search_re)
+		regex_free(editor.search_re);
+	editor.search_re = regex_compile(str, len, &error);
+	if (!editor.search_re)
+		return -1;
+	if (buf->used >= SEARCH_BACKGROUND_MIN) {
+		search_job_new(str, len, editor.cursor_last, regex_compile(str, len, &error));
+		return -1;
 	}
+	if (editor.search_dir == SEARCH_FORWARD)
+		return regex_search_forward(editor.search_re, buf, editor.cursor_last, &end);
+	return regex_search_backward(editor.search_re, buf, editor.cursor_last, &end);
 }
 static void search_update(void)
 {
+	struct buffer *buf = editor.buf_current;
 	char *text;
+	int p;
 
+	search_job_stop();
 	text = buffer_get_content(editor.minibuf.buf);
 
 	if (editor.minibuf.buf->used == 0) {
-		editor.buf_current->cursor = editor.cursor_last;
-		editor.buf_current->cur_line = editor.line_last;
+		buf->cursor = editor.cursor_last;
+		buf->cur_line = editor.line_last;
 	} else {
-		search_update_common(text);
-		editor.search_last = strdup(text); /* TODO: LEAK! */
+		if (editor.search_regex)
+			p = search_regex(text, editor.minibuf.buf->used);
+		else
+			p = search_incremental(text, editor.minibuf.buf->used);
+		if (p >= 0)
+			buffer_set_cursor(buf, p);
+		free(editor.search_last);
+		editor.search_last = strdup(text);
 	}
 	free(text);
 
@@ -1579,6 +3785,7 @@ static void search_update(void)
 }
 static void search_cancel(void)
 {
+	search_job_stop();
 	editor.mode = M_COMMAND;
 	editor.buf_current->cursor = editor.cursor_last;
 	editor.buf_current->cur_line = editor.line_last;
@@ -1591,60 +3798,91 @@ static int command_search_common(char *prompt)
 	editor.line_last = editor.buf_current->cur_line;
 	editor.mode = M_MINIBUFFER;
 	editor.minibuf.prompt = prompt;
+	editor.search_hits_len = 0;
 	editor.minibuf.action_cb = search_action;
 	editor.minibuf.update_cb = search_update;
 	editor.minibuf.cancel_cb = search_cancel;
 	return 0;
 }
 
+static char *search_prompt(void)
+{
+	if (editor.search_dir == SEARCH_FORWARD)
+		return editor.search_regex ? "Regex → " : "Search → ";
+	return editor.search_regex ? "Regex ← " : "Search ← ";
+}
+
 int command_search_forward(void)
 {
 	editor.search_dir = SEARCH_FORWARD;
-	return command_search_common("Search → ");
+	return command_search_common(search_prompt());
 }
 
 int command_search_backward(void)
 {
 	editor.search_dir = SEARCH_BACKWARD;
-	return command_search_common("Search ← ");
+	return command_search_common(search_prompt());
+}
+
+/* Switch between literal and regex search while the pattern is typed. */
+int command_search_toggle_regex(void)
+{
+	if (editor.minibuf.update_cb != search_update)
+		return 0;
+
+	editor.search_regex = !editor.search_regex;
+	editor.minibuf.prompt = search_prompt();
+	editor.search_hits_len = 0;
+	search_update();
+	return 0;
 }
 
 int command_goto_next_search(void)
 {
-	int p, nl;
+	int p, nl, end;
 
 	editor.mode = M_COMMAND;
 	if (!editor.search_last)
 		return 0;
 
+	if (editor.search_regex) {
+		p = editor.search_re ? regex_search_forward(editor.search_re, editor.buf_current,
+							    editor.buf_current->cursor + 1, &end) : -1;
+		if (p >= 0)
+			buffer_set_cursor(editor.buf_current, p);
+		return 0;
+	}
 	p = buffer_find_str_next(editor.buf_current,
 				 editor.buf_current->cursor + 1,
 				 editor.search_last,
 				 &nl);
-	if (p >= 0) {
-		editor.buf_current->cursor += p + 1;
-		editor.buf_current->cur_line += nl;
-	}
+	if (p >= 0)
+		buffer_set_cursor(editor.buf_current, editor.buf_current->cursor + 1 + p);
 
 	return 0;
 }
 
 int command_goto_previous_search(void)
 {
-	int p, nl;
+	int p, nl, end;
 
 	editor.mode = M_COMMAND;
 	if (!editor.search_last)
 		return 0;
 
+	if (editor.search_regex) {
+		p = editor.search_re ? regex_search_backward(editor.search_re, editor.buf_current,
+							     editor.buf_current->cursor, &end) : -1;
+		if (p >= 0)
+			buffer_set_cursor(editor.buf_current, p);
+		return 0;
+	}
 	p = buffer_find_str_prev(editor.buf_current,
 				 editor.buf_current->cursor,
 				 editor.search_last,
 				 &nl);
-	if (p >= 0) {
-		editor.buf_current->cursor = p;
-		editor.buf_current->cur_line = nl;
-	}
+	if (p >= 0)
+		buffer_set_cursor(editor.buf_current, p);
 
 	return 0;
 }
@@ -1693,7 +3931,11 @@ int command_previous_buffer(void)
 
 int command_recenter(void)
 {
-	editor.screen_start = max(0, editor.buf_current->cur_line - editor.screen_width / 2 + 2);
+	struct buffer *buf = editor.buf_current;
+
+	editor.screen_start = buf->cur_line;
+	editor.screen_row = editor_cursor_row(buf);
+	editor_rows_back(buf, &editor.screen_start, &editor.screen_row, editor.screen_width / 2 - 2);
 	return 0;
 }
 
@@ -1728,6 +3970,21 @@ int command_minibuffer_insert_self_and_update(void)
 	return 0;
 }
 
+/* The minibuffer only takes the first line of pasted text. */
+int command_minibuffer_insert_paste(void)
+{
+	char *nl;
+	int len = editor.paste_len;
+
+	nl = memchr(editor.paste, '\n', len);
+	if (nl)
+		len = nl - editor.paste;
+	buffer_insert_string(editor.minibuf.buf, editor.paste, len);
+	if (editor.minibuf.update_cb)
+		editor.minibuf.update_cb();
+	return 0;
+}
+
 int command_minibuffer_cancel(void)
 {
 	if (editor.minibuf.cancel_cb)
@@ -1735,19 +3992,75 @@ int command_minibuffer_cancel(void)
 	return 0;
 }
 
+/* Have the terminal mark text pasted into it, see editor_read_paste(). */
+static void editor_paste_mode(bool on)
+{
+	const char *seq = on ? "\x1b[?2004h" : "\x1b[?2004l";
+
+	fflush(stdout);
+	if (write(STDOUT_FILENO, seq, strlen(seq)) < 0)
+		return;
+}
+
+static void editor_end(void)
+{
+	editor_paste_mode(false);
+	if (editor.output == OUTPUT_VT)
+		vt_end();
+	endwin();
+}
+
 /* Does not return */
 int command_editor_quit(void)
 {
-	endwin();
+	editor_end();
 	exit(0);
 }
 
-static int get_input(void)
+/* Read the text of a paste up to its end marker into "editor.paste".
+ * Keys the terminal makes of the text are taken for what they were typed as
+ * or dropped. The text may arrive in bursts with long pauses in between, so
+ * the paste only ends early if the marker never comes.
+ */
+static void editor_read_paste(void)
+{
+	int c;
+
+	editor.paste_len = 0;
+	wtimeout(input, PASTE_TIMEOUT_MS);
+	while ((c = wgetch(input)) != ERR && c != KEY_PASTE_END) {
+		if (c == '\r' || c == KEY_ENTER)
+			c = '\n';
+		else if (c == KEY_BACKSPACE)
+			c = 127;
+		else if (c > 0xff)
+			continue;
+		if (editor.paste_len == editor.paste_size) {
+			editor.paste_size = max(BUFFER_READ_CHUNK, editor.paste_size * 2);
+			editor.paste = realloc(editor.paste, editor.paste_size);
+			if (!editor.paste)
+				oom();
+		}
+		editor.paste[editor.paste_len++] = c;
+	}
+}
+
+/* Return the next key, waiting for one if "wait" is true, or ERR. */
+static int get_input(bool wait)
 {
+	struct match_count *mc = editor.buf_current->matches;
 	int c;
 
-	c = wgetch(stdscr);
-	if (c == KEY_ENTER || c == '\n')
+	/* Only look for keys typed ahead, or else wake up now and then to see
+	   to searching or counting in the background. */
+	if (!wait)
+		wtimeout(input, 0);
+	else
+		wtimeout(input, (editor.search_job || mc && !mc->complete) ? SEARCH_POLL_MS : -1);
+	c = wgetch(input);
+	if (c == KEY_PASTE)
+		editor_read_paste();
+	else if (c == KEY_ENTER || c == '\n')
 		return KEY_ENTER;
 	else if (c == KEY_BACKSPACE || c == 127)
 		return KEY_BACKSPACE;
@@ -1755,14 +4068,30 @@ static int get_input(void)
 	return c;
 }
 
+/* See to the work going on in the background.
+ * Return true if the screen has to be redrawn.
+ */
+static bool editor_poll(void)
+{
+	bool redraw;
+
+	redraw = search_job_poll();
+	if (match_count_poll(editor.buf_current))
+		redraw = true;
+
+	return redraw;
+}
+
 static void finish(int sig)
 {
-	endwin();
+	editor_end();
 	exit(0);
 }
 
 int main(int argc, char **argv)
 {
+	int key;
+
 	signal(SIGINT, finish);
 
 	setlocale(LC_ALL, "");
@@ -1771,16 +4100,34 @@ int main(int argc, char **argv)
 	raw();
 	noecho();
 	keypad(stdscr, TRUE);
+	/* Let curses scroll with the terminal's line operations. */
+	idlok(stdscr, TRUE);
+	define_key("\x1b[200~", KEY_PASTE);
+	define_key("\x1b[201~", KEY_PASTE_END);
 
 	editor_init(argc, argv);
+	input = stdscr;
+	if (editor.output == OUTPUT_VT) {
+		/* Let curses clear the screen once, then only read keys through
+		   a window that never changes and doesn't move the cursor. */
+		refresh();
+		input = newwin(1, 1, 0, 0);
+		leaveok(input, TRUE);
+		keypad(input, TRUE);
+		vt_init(colors, color_pairs, COLOR_ID_BASE00, COLOR_ID_BASE3);
+	}
+	editor_paste_mode(true);
 
 	for (;;) {
-		doupdate();
-
-		clear();
+		editor_update_match_count();
 		editor_show_status_line();
 		editor_update_screen();
 		editor_redisplay();
-		editor_process_key(get_input());
+		screen_flush();
+		while ((key = get_input(true)) == ERR && !editor_poll())
+			;
+		/* Handle every key typed meanwhile before drawing again. */
+		for (; key != ERR; key = get_input(false))
+			editor_process_key(key);
 	}
 }
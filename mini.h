@@ -25,6 +25,10 @@
 #define KEY_ESC 0x1b
 /* KEY_ANY keybindings have to be ordered *after* everything else, they are a catch-all. */
 #define KEY_ANY 0xff
+/* Text pasted into the terminal, read whole between the bracketed paste
+   markers. */
+#define KEY_PASTE (KEY_MAX + 1)
+#define KEY_PASTE_END (KEY_MAX + 2)
 #define CTRL(c) ((c) - 0x60)
 #define CTRL_SPACE 0x00
 
@@ -34,6 +38,154 @@
 /** Buffer */
 
 #define BUFFER_ALLOC_CHUNK 256
+#define BUFFER_READ_CHUNK (64 * 1024)
+/* Gap buffers at least this large give memory back when mostly empty. */
+#define BUFFER_SHRINK_THRESHOLD (1024 * 1024)
+/* Gap buffers at least this large are backed by huge pages if possible. */
+#define BUFFER_ADVISE_THRESHOLD (32 * 1024 * 1024)
+/* Files at least this large are not kept in a plain gap buffer. */
+#define BUFFER_LARGE_FILE (16 * 1024 * 1024)
+#define LINE_INDEX_ALLOC_CHUNK 64
+#define LINE_INDEX_SCAN_CHUNK (1024 * 1024)
+/* Regex matches to highlight are looked for this far before and after the
+   text of a screen row, no further. */
+#define SEARCH_MARK_CONTEXT (4 * 1024)
+/* Display columns are remembered every this many bytes of a line. */
+#define COLUMN_CHECKPOINT 512
+#define COLUMN_CACHE_ALLOC_CHUNK 64
+/* Number of lines whose display columns are remembered per buffer. */
+#define COLUMN_CACHE_LINES 8
+/* Number of lines around the screen whose wrapped height is remembered. */
+#define WRAP_MAP_LINES 1024
+/* Default memory for the undo log of a buffer, in megabytes. */
+#define UNDO_LOG_MAX_MB 256
+#define UNDO_ALLOC_CHUNK 64
+/* Memory for deleted text that can be pasted back, and the number of
+   deletions kept in it. */
+#define KILL_RING_SIZE (4 * 1024 * 1024)
+#define KILL_RING_ENTRIES 32
+/* Buffers read by another thread are read at most this much at a time, so
+   that the reader notices soon when it is told to stop. */
+#define BUFFER_CANCEL_SPAN (1024 * 1024)
+/* Spans of text handed to one writev when saving. */
+#define BUFFER_WRITE_SPANS 64
+/* Matches of the last search are counted in the background this much at a
+   time, keeping at most MATCH_COUNT_MAX of their positions. */
+#define MATCH_COUNT_CHUNK (1024 * 1024)
+#define MATCH_COUNT_MAX (4 * 1024 * 1024)
+/* How often to show how counting is getting on, in milliseconds. */
+#define MATCH_COUNT_PROGRESS_MS 200
+
+/* Positions of line beginnings, kept in a gap array like the buffer text.
+ * Entries before the gap are absolute positions, entries after the gap are
+ * stored as a distance from "indexed". An edit then only has to move the gap
+ * to the edited line instead of shifting every following entry.
+ * Text is indexed lazily: only lines beginning up to "indexed" are known.
+ */
+struct line_index {
+	int *starts;
+	int size;
+	int gap_start;
+	int gap_end;
+	int indexed;
+};
+
+/* Display columns of one line, sampled every COLUMN_CHECKPOINT bytes:
+ * "cols[i]" is the column at position "line_start" + i * COLUMN_CHECKPOINT.
+ * Checkpoints are computed lazily and an edit drops only those after it,
+ * so finding a column never scans more than one checkpoint interval.
+ */
+struct column_cache {
+	int line_start;		/* -1 if no line is cached */
+	int line_end;		/* -1 if not reached yet */
+	int *cols;
+	int len;
+	int size;
+	/* When the line was last looked up, to find one to forget. */
+	unsigned last_used;
+};
+
+/* Number of screen rows each line takes when long lines are wrapped, for
+ * lines "first" to "first" + "len" around the screen, or -1 if not known.
+ * An edit forgets the height of its line, and of the lines after it if it
+ * adds or removes a line.
+ */
+struct wrap_map {
+	int width;
+	int first;
+	int *rows;
+	int len;
+};
+
+/* An edit as recorded for undo: "len" bytes inserted or deleted at "pos".
+ * The bytes are in the arena of the log at "text", counted from the first
+ * byte the arena ever held.
+ */
+struct undo_op {
+	int pos;
+	int len;
+	long long text;
+	bool insert;
+	/* Characters typed one at a time, the next one is added to it. */
+	bool typed;
+};
+
+/* The edits of a buffer that can be undone, oldest first. Those before
+ * "done" are in effect, the rest were undone and can be redone. Their text
+ * is kept in one arena holding the bytes from "base" on. The oldest edits
+ * are forgotten to keep the arena below "max" bytes.
+ */
+struct undo_log {
+	struct undo_op *ops;
+	int len;
+	int done;
+	int size;
+	char *arena;
+	long long base;
+	size_t used;
+	size_t arena_size;
+	size_t max;
+	/* Edits are not recorded while loading or undoing. */
+	bool suspended;
+};
+
+struct kill {
+	size_t start;
+	size_t len;
+};
+
+/* Deleted text, the last KILL_RING_ENTRIES deletions at most, oldest first
+ * from "first" on. Their text is kept in "store", used round and round: a
+ * new entry goes after the newest one, or at the beginning of the store if
+ * it does not fit there, and takes the place of the oldest entries in its
+ * way. The store only grows for an entry bigger than all of it.
+ */
+struct kill_ring {
+	struct kill entries[KILL_RING_ENTRIES];
+	int first;
+	int count;
+	char *store;
+	size_t size;
+};
+
+enum storage {
+	STORAGE_GAP,
+	STORAGE_PIECE,
+	STORAGE_ROPE,
+};
+
+struct piece_table;
+struct rope;
+struct regex;
+struct search_job;
+struct match_count;
+
+/* A contiguous run of buffer text beginning at buffer position "pos". */
+struct span {
+	const char *data;
+	int pos;
+	int len;
+};
 
 struct buffer {
 	struct buffer *buf_next;
@@ -44,28 +196,49 @@ struct buffer {
 	unsigned used;
 	int cursor;
 	int cur_line;
-	int last_line;
 	bool modified;
+	/* -1 until read after the cursor moves */
 	int cursor_column;
 	int sel_start;
 	int sel_end;
 	bool sel_active;
+	enum storage storage;
 	int gap_start;
 	int gap_end;
 	char *data;
+	struct piece_table *pieces;
+	struct rope *rope;
+	struct line_index lines;
+	struct column_cache columns[COLUMN_CACHE_LINES];
+	unsigned columns_clock;
+	struct wrap_map wrap;
+	struct undo_log undo;
+	/* Set on copies of the buffer read by another thread: the text seems
+	   to end once this becomes nonzero. */
+	const int *cancel;
+	/* Set on the copies that search a chunk in parallel: the text also ends
+	   once "*found", a match, is before the chunk beginning at "chunk". */
+	const int *found;
+	int chunk;
+	/* Matches of the last search, NULL if not counted. */
+	struct match_count *matches;
 };
 
 /* Buffer content */
 struct buffer *buffer_new(void);
 void buffer_free(struct buffer *buf);
 int buffer_save(struct buffer *buf, const char *path);
-int buffer_load(struct buffer *buf, const char *path);
+int buffer_load(struct buffer *buf, const char *path, enum storage storage);
 void buffer_set_path(struct buffer *buf, const char *path);
 
 /* Buffer internal */
 int cursor_to_data(struct buffer *buf, int pos);
 char buffer_data_at(struct buffer *buf, int pos);
+void buffer_copy(struct buffer *buf, int pos, int n, char *dst);
+bool buffer_span_forward(struct buffer *buf, int pos, int end, struct span *sp);
+bool buffer_span_backward(struct buffer *buf, int pos, int beg, struct span *sp);
 void buffer_expand(struct buffer *buf, size_t chunk);
+void buffer_reserve(struct buffer *buf, size_t n);
 void buffer_adjust_gap(struct buffer *buf);
 int buffer_get_next_newline(struct buffer *buf, int from, int way);
 int buffer_get_line_beginning(struct buffer *buf);
@@ -74,6 +247,7 @@ int buffer_get_line_offset(struct buffer *buf);
 int buffer_get_line_length(struct buffer *buf);
 void buffer_get_region(struct buffer *buf, int line_start, int lines, int *beg, int *end);
 void buffer_get_yx(struct buffer *buf, int *y, int *x);
+void buffer_set_cursor(struct buffer *buf, int pos);
 char *buffer_get_content(struct buffer *buf);
 int buffer_find_char(struct buffer *buf, int from, int way, const char *accept, int *newlines);
 int buffer_find_char_next(struct buffer *buf, int from, const char *accept, int *newlines);
@@ -81,6 +255,11 @@ int buffer_find_char_prev(struct buffer *buf, int from, const char *accept, int
 int buffer_find_str_next(struct buffer *buf, int from, const char *str, int *newlines);
 int buffer_find_str_prev(struct buffer *buf, int from, const char *str, int *newlines);
 
+/* Buffer lines */
+int buffer_line_start(struct buffer *buf, int line);
+int buffer_line_at(struct buffer *buf, int pos);
+int buffer_last_line(struct buffer *buf);
+
 /* Buffer movement */
 void buffer_move_forward_char(struct buffer *buf);
 void buffer_move_backward_char(struct buffer *buf);
@@ -108,6 +287,10 @@ void buffer_delete_line(struct buffer *buf, char **out, int *n_out);
 void buffer_delete_selection(struct buffer *buf, char **out, int *n_out);
 void buffer_clear(struct buffer *buf);
 
+/* Buffer undo */
+bool buffer_undo(struct buffer *buf);
+bool buffer_redo(struct buffer *buf);
+
 /* Buffer selection */
 void buffer_selection_toggle(struct buffer *buf);
 void buffer_selection_update(struct buffer *buf);
@@ -118,6 +301,7 @@ int buffer_search_backward(struct buffer *buf, const char *str);
 
 /* Utils */
 static inline int max(int a, int b) { return ((a > b) ? a : b); }
+static inline int min(int a, int b) { return ((a < b) ? a : b); }
 bool is_position_in_buffer(int pos, struct buffer *buf);
 bool is_position_in_region(int pos, int beg, int end);
 int str_newlines(const char *str, int n);
@@ -127,6 +311,18 @@ void oom();
 
 /** Editor */
 
+/* Incremental search in buffers this large runs in the background... */
+#define SEARCH_BACKGROUND_MIN (1024 * 1024)
+/* ...once no key has been pressed for this many milliseconds. */
+#define SEARCH_DEBOUNCE_MS 30
+/* How often to check whether a background search is done, in milliseconds. */
+#define SEARCH_POLL_MS 10
+/* A paste missing its end marker ends once no text came for this long. */
+#define PASTE_TIMEOUT_MS (10 * 1000)
+
+/* FNV-1a offset basis, for hashing what is on screen. */
+#define HASH_INIT 0xcbf29ce484222325ULL
+
 enum mode {
 	M_COMMAND   = 0x1,
 	M_EDITING   = 0x2,
@@ -151,6 +347,11 @@ struct keybinding {
 	int (*command)(void);
 };
 
+enum output {
+	OUTPUT_CURSES,
+	OUTPUT_VT,
+};
+
 struct editor {
 	struct buffer *buf_first;
 	struct buffer *buf_last;
@@ -159,13 +360,55 @@ struct editor {
 	enum mode mode;
 	int screen_start;
 	int screen_width;
-	int clipboard_len;
-	char *clipboard;
+	/* The first display column shown of every line, a multiple of
+	   TAB_STOP so that tabs line up the same as in the text. */
+	int screen_left;
+	/* Wrap long lines instead of scrolling sideways. The screen then
+	   begins at row "screen_row" of line "screen_start". */
+	bool wrap;
+	int screen_row;
+	struct kill_ring kills;
+	/* Memory for the undo log of every buffer, in bytes. */
+	size_t undo_max;
+	/* The text of the last KEY_PASTE. */
+	char *paste;
+	int paste_len;
+	int paste_size;
 	int cursor_last;
 	int line_last;
 	int key_last;
+	/* The command run for the previous key. */
+	int (*command_last)(void);
 	char *search_last;
 	enum { SEARCH_FORWARD, SEARCH_BACKWARD } search_dir;
+	/* Incremental search: match position for every prefix of the pattern
+	   typed so far, or -1. */
+	int *search_hits;
+	int search_hits_len;
+	int search_hits_size;
+	/* Search for regular expressions instead of literal text. */
+	bool search_regex;
+	/* The compiled "search_last" in regex mode, NULL if it is invalid. */
+	struct regex *search_re;
+	/* Matches of "search_last" on a screen row as begin and end pairs,
+	   found anew for every row laid out. */
+	int *search_marks;
+	int search_marks_len;
+	int search_marks_size;
+	/* The search waiting to start or running in the background, if any. */
+	struct search_job *search_job;
+	/* A hash of what every row of the terminal shows, so that only rows
+	   that change are drawn. */
+	unsigned long long *screen_rows;
+	int screen_rows_len;
+	bool screen_stale;
+	/* The buffer and its first line and row the text rows were last drawn
+	   for. */
+	struct buffer *screen_drawn_buf;
+	int screen_drawn_start;
+	int screen_drawn_row;
+	enum output output;
+	enum storage storage;
 	struct keybinding *keybindings;
 };
 
@@ -177,6 +420,7 @@ void editor_save(bool save_as);
 void editor_load_file(void);
 char *editor_dialog(const char *prompt);
 void editor_error(const char *error);
+void editor_invalidate(void);
 void editor_show_status_line(void);
 void editor_update_screen(void);
 void editor_redisplay(void);
@@ -211,11 +455,16 @@ int command_delete_backward_word(void);
 int command_delete_selection_or_line(void);
 int command_clear(void);
 int command_paste(void);
+int command_undo(void);
+int command_redo(void);
+int command_insert_paste(void);
+int command_ignore(void);
 int command_toggle_selection_mode(void);
 int command_search_forward(void);
 int command_search_backward(void);
 int command_goto_next_search(void);
 int command_goto_previous_search(void);
+int command_search_toggle_regex(void);
 int command_editor_command_mode(void);
 int command_editor_editing_mode(void);
 int command_save_buffer(void);
@@ -228,6 +477,7 @@ int command_minibuffer_do_action(void);
 int command_minibuffer_delete_backward_char(void);
 int command_minibuffer_clear(void);
 int command_minibuffer_insert_self_and_update(void);
+int command_minibuffer_insert_paste(void);
 int command_minibuffer_cancel(void);
 int command_editor_quit(void);
 
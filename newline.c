@@ -0,0 +1,250 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define NEWLINE_X86
+#include <immintrin.h>
+#endif
+
+#include "newline.h"
+
+/* All kernels share the semantics of the public functions:
+ *
+ * count:  number of newlines in "s".
+ * find:   pointer to the "*nth" newline (counting from 1) in "s". If there are
+ *         fewer, return NULL and decrease "*nth" by the number of newlines
+ *         seen, so that the search can continue in the next run of text.
+ * rfind:  same as find, but counting from the end of "s" backward.
+ */
+
+static int count_scalar(const char *s, int n)
+{
+	int nl = 0, i;
+
+	for (i = 0; i < n; i++)
+		nl += s[i] == '\n';
+
+	return nl;
+}
+
+static const char *find_scalar(const char *s, int n, int *nth)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (s[i] == '\n' && --*nth == 0)
+			return s + i;
+	}
+
+	return NULL;
+}
+
+static const char *rfind_scalar(const char *s, int n, int *nth)
+{
+	int i;
+
+	for (i = n - 1; i >= 0; i--) {
+		if (s[i] == '\n' && --*nth == 0)
+			return s + i;
+	}
+
+	return NULL;
+}
+
+#ifdef NEWLINE_X86
+
+/* Return the bit of the "nth" set bit in "mask", counting from the lowest. */
+static int nth_bit(uint32_t mask, int nth)
+{
+	while (--nth > 0)
+		mask &= mask - 1;
+	return __builtin_ctz(mask);
+}
+
+/* Return the bit of the "nth" set bit in "mask", counting from the highest. */
+static int nth_bit_reverse(uint32_t mask, int nth)
+{
+	while (--nth > 0)
+		mask &= ~(0x80000000u >> __builtin_clz(mask));
+	return 31 - __builtin_clz(mask);
+}
+
+/* SSE2 is part of x86-64, no need to check for it. */
+static int count_sse2(const char *s, int n)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	int total = 0, i = 0;
+
+	while (n - i >= 16) {
+		__m128i acc = _mm_setzero_si128();
+		int k;
+
+		/* Every byte lane counts down by one per newline; flush the
+		   lanes before any of them can wrap around. */
+		for (k = 0; k < 255 && n - i >= 16; k++, i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+		}
+		acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+		total += _mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4);
+	}
+
+	return total + count_scalar(s + i, n - i);
+}
+
+static const char *find_sse2(const char *s, int n, int *nth)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	int i;
+
+	for (i = 0; n - i >= 16; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		int c = __builtin_popcount(mask);
+
+		if (c >= *nth)
+			return s + i + nth_bit(mask, *nth);
+		*nth -= c;
+	}
+
+	return find_scalar(s + i, n - i, nth);
+}
+
+static const char *rfind_sse2(const char *s, int n, int *nth)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	int i;
+
+	for (i = n; i >= 16; i -= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i - 16));
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		int c = __builtin_popcount(mask);
+
+		if (c >= *nth)
+			return s + i - 16 + nth_bit_reverse(mask, *nth);
+		*nth -= c;
+	}
+
+	return rfind_scalar(s, i, nth);
+}
+
+__attribute__((target("avx2,popcnt")))
+static int count_avx2(const char *s, int n)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	int total = 0, i = 0;
+
+	while (n - i >= 32) {
+		__m256i acc = _mm256_setzero_si256();
+		int k;
+
+		for (k = 0; k < 255 && n - i >= 32; k++, i += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+			acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+		}
+		acc = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+		total += _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1)
+		       + _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+	}
+
+	return total + count_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char *find_avx2(const char *s, int n, int *nth)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	int i;
+
+	for (i = 0; n - i >= 32; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		int c = __builtin_popcount(mask);
+
+		if (c >= *nth)
+			return s + i + nth_bit(mask, *nth);
+		*nth -= c;
+	}
+
+	return find_sse2(s + i, n - i, nth);
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char *rfind_avx2(const char *s, int n, int *nth)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	int i;
+
+	for (i = n; i >= 32; i -= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i - 32));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		int c = __builtin_popcount(mask);
+
+		if (c >= *nth)
+			return s + i - 32 + nth_bit_reverse(mask, *nth);
+		*nth -= c;
+	}
+
+	return rfind_sse2(s, i, nth);
+}
+
+#endif
+
+static int (*count_kernel)(const char *, int);
+static const char *(*find_kernel)(const char *, int, int *);
+static const char *(*rfind_kernel)(const char *, int, int *);
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/* Pick the best kernels for this CPU, once: the first calls may come from
+   several search threads at the same time. */
+static void newline_resolve(void)
+{
+	count_kernel = count_scalar;
+	find_kernel = find_scalar;
+	rfind_kernel = rfind_scalar;
+#ifdef NEWLINE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+		count_kernel = count_avx2;
+		find_kernel = find_avx2;
+		rfind_kernel = rfind_avx2;
+	} else {
+		count_kernel = count_sse2;
+		find_kernel = find_sse2;
+		rfind_kernel = rfind_sse2;
+	}
+#endif
+}
+
+/* Count newlines in the "n" bytes at "s". */
+int newline_count(const char *s, int n)
+{
+	pthread_once(&kernels_once, newline_resolve);
+	return count_kernel(s, n);
+}
+
+/* Find the "*nth" newline in the "n" bytes at "s".
+ * Return NULL if there are fewer, with "*nth" decreased by the number found.
+ */
+const char *newline_find(const char *s, int n, int *nth)
+{
+	pthread_once(&kernels_once, newline_resolve);
+	return find_kernel(s, n, nth);
+}
+
+/* Like newline_find(), but count newlines from the end of "s" backward. */
+const char *newline_rfind(const char *s, int n, int *nth)
+{
+	pthread_once(&kernels_once, newline_resolve);
+	return rfind_kernel(s, n, nth);
+}
@@ -0,0 +1,16 @@
+#pragma once
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Newline kernels. The implementation is picked once, on the first call,
+ * based on what the CPU supports: AVX2, SSE2 or plain C.
+ */
+int newline_count(const char *s, int n);
+const char *newline_find(const char *s, int n, int *nth);
+const char *newline_rfind(const char *s, int n, int *nth);
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Searching a large buffer with several threads.
+ *
+ * The text from where the search begins to the end of the buffer is handed
+ * out in chunks, in order, to threads that search them independently. Once
+ * a match is found no more chunks are handed out: any chunk not taken yet
+ * lies after it. Threads searching a chunk after the match see its text end
+ * at their next span and give up. The threads still searching earlier
+ * chunks finish, and the earliest match wins.
+ *
+ * The buffer isn't changed while it is searched, but looking up a position
+ * in a piece table or a rope updates a cache. Every thread therefore reads
+ * the buffer through a copy of its structures with a cache of its own, a
+ * view. Views are also how a search runs in the background.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mini.h"
+#include "parallel.h"
+#include "piece.h"
+#include "rope.h"
+
+struct view {
+	struct buffer buf;
+	struct piece_table pieces;
+	struct rope rope;
+};
+
+struct job {
+	struct buffer *buf;
+	parallel_fn fn;
+	void *arg;
+	pthread_mutex_t lock;
+	/* Where the next chunk begins. */
+	int next;
+	/* The earliest match so far, -1 if none. Read without the lock by the
+	   views, to stop searching chunks that begin after it. */
+	int found;
+	int found_end;
+};
+
+struct worker {
+	struct job *job;
+	struct view view;
+	int index;
+};
+
+/* Search with this many threads whatever the size of the text, 0 for one
+   per CPU on large texts. */
+static int forced_threads;
+static int chunk_size = PARALLEL_CHUNK;
+
+/* Make a copy of "buf" that can only be used for reading the text. */
+static void view_init(struct view *v, struct buffer *buf)
+{
+	v->buf = *buf;
+	if (buf->storage == STORAGE_PIECE) {
+		v->pieces = *buf->pieces;
+		v->buf.pieces = &v->pieces;
+	} else if (buf->storage == STORAGE_ROPE) {
+		v->rope = *buf->rope;
+		v->buf.rope = &v->rope;
+	}
+}
+
+/* Return a copy of "buf" for another thread to read the text through, for
+ * as long as "buf" isn't changed. Its text ends once "cancel" is nonzero.
+ */
+struct buffer *parallel_view_new(struct buffer *buf, const int *cancel)
+{
+	struct view *v;
+
+	v = malloc(sizeof(struct view));
+	if (!v)
+		oom();
+	view_init(v, buf);
+	v->buf.cancel = cancel;
+
+	return &v->buf;
+}
+
+void parallel_view_free(struct buffer *view)
+{
+	free(view);
+}
+
+static void *worker_run(void *data)
+{
+	struct worker *w = data;
+	struct job *job = w->job;
+	int beg, end, p, e;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		beg = job->next;
+		if (job->found >= 0 || beg > (int)job->buf->used) {
+			pthread_mutex_unlock(&job->lock);
+			return NULL;
+		}
+		/* A match may begin at the very end of the text. */
+		end = min(beg + chunk_size, job->buf->used + 1);
+		job->next = end;
+		pthread_mutex_unlock(&job->lock);
+		w->view.buf.chunk = beg;
+
+		p = job->fn(&w->view.buf, beg, end, w->index, job->arg, &e);
+		if (p < 0)
+			continue;
+		pthread_mutex_lock(&job->lock);
+		if (job->found < 0 || p < job->found) {
+			__atomic_store_n(&job->found, p, __ATOMIC_RELAXED);
+			job->found_end = e;
+		}
+		pthread_mutex_unlock(&job->lock);
+	}
+}
+
+/* For tests: make every search use "threads" threads and chunks of "chunk"
+ * bytes, so that small texts are split too. Zeros restore the defaults.
+ */
+void parallel_force(int threads, int chunk)
+{
+	forced_threads = min(threads, PARALLEL_MAX_THREADS);
+	chunk_size = chunk > 0 ? chunk : PARALLEL_CHUNK;
+}
+
+/* Return the number of threads to search "buf" from "from" with. */
+int parallel_threads(struct buffer *buf, int from)
+{
+	long n;
+
+	if (forced_threads > 0)
+		return forced_threads;
+	if ((int)buf->used - from < PARALLEL_MIN_SIZE)
+		return 1;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n < 1) ? 1 : min(n, PARALLEL_MAX_THREADS);
+}
+
+/* Find the first match that begins at "from" or later, with "n_threads"
+ * threads calling "fn" on chunks of "buf".
+ * Return its position and its end in "match_end", or -1 if not found.
+ */
+int parallel_search(struct buffer *buf, int from, int n_threads, parallel_fn fn, void *arg,
+		    int *match_end)
+{
+	struct worker workers[PARALLEL_MAX_THREADS];
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	struct job job;
+	int i, started;
+
+	if (n_threads <= 1)
+		return fn(buf, from, buf->used + 1, 0, arg, match_end);
+
+	job.buf = buf;
+	job.fn = fn;
+	job.arg = arg;
+	job.next = from;
+	job.found = -1;
+	job.found_end = -1;
+	pthread_mutex_init(&job.lock, NULL);
+
+	/* This thread searches too, as the first worker. A thread that can't be
+	   started just leaves more chunks to the others. */
+	n_threads = min(n_threads, PARALLEL_MAX_THREADS);
+	for (i = 0, started = 0; i < n_threads; i++) {
+		workers[i].job = &job;
+		workers[i].index = i;
+		view_init(&workers[i].view, buf);
+		workers[i].view.buf.found = &job.found;
+		if (i > 0 && pthread_create(&threads[started], NULL, worker_run, &workers[i]) == 0)
+			started++;
+	}
+	worker_run(&workers[0]);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	if (job.found >= 0)
+		*match_end = job.found_end;
+	return job.found;
+}
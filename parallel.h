@@ -0,0 +1,32 @@
+#pragma once
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Searches over less text than this run on a single thread. */
+#define PARALLEL_MIN_SIZE (32 * 1024 * 1024)
+/* Threads take the text in chunks this large, in order. */
+#define PARALLEL_CHUNK (4 * 1024 * 1024)
+#define PARALLEL_MAX_THREADS 16
+
+struct buffer;
+
+/* Find the first match that begins at "beg" or later, but before "end".
+ * "buf" may be read from "beg" on, also past "end"; "thread" tells which of
+ * the threads is searching. Return the position and the end of the match
+ * in "match_end", or -1 if not found.
+ */
+typedef int (*parallel_fn)(struct buffer *buf, int beg, int end, int thread, void *arg,
+			   int *match_end);
+
+struct buffer *parallel_view_new(struct buffer *buf, const int *cancel);
+void parallel_view_free(struct buffer *view);
+void parallel_force(int threads, int chunk);
+int parallel_threads(struct buffer *buf, int from);
+int parallel_search(struct buffer *buf, int from, int n_threads, parallel_fn fn, void *arg,
+		    int *match_end);
@@ -0,0 +1,301 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "mini.h"
+#include "piece.h"
+
+struct piece_table *piece_table_new(void)
+{
+	struct piece_table *pt;
+
+	pt = calloc(1, sizeof(struct piece_table));
+	if (!pt)
+		oom();
+	pt->alloc = PIECE_ALLOC_CHUNK;
+	pt->pieces = calloc(pt->alloc, sizeof(struct piece));
+	if (!pt->pieces)
+		oom();
+
+	return pt;
+}
+
+/* Create a piece table over the first "len" bytes of file "fd".
+ * The file is mapped read-only and never copied.
+ * Return NULL if the file can't be mapped.
+ */
+struct piece_table *piece_table_map(int fd, size_t len)
+{
+	struct piece_table *pt;
+	char *map;
+
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	pt = piece_table_new();
+	pt->map = map;
+	pt->map_len = len;
+	pt->pieces[0].data = map;
+	pt->pieces[0].len = len;
+	pt->pieces[0].pos = 0;
+	pt->n_pieces = 1;
+	pt->numbered = 1;
+
+	return pt;
+}
+
+static void piece_add_free(struct piece_table *pt)
+{
+	struct add_block *b = pt->add;
+
+	while (b) {
+		struct add_block *next = b->next;
+
+		free(b);
+		b = next;
+	}
+	pt->add = NULL;
+}
+
+void piece_table_free(struct piece_table *pt)
+{
+	piece_add_free(pt);
+	if (pt->map)
+		munmap(pt->map, pt->map_len);
+	free(pt->pieces);
+	free(pt);
+}
+
+void piece_table_clear(struct piece_table *pt)
+{
+	piece_add_free(pt);
+	pt->n_pieces = 0;
+	pt->numbered = 0;
+	pt->cache_index = 0;
+}
+
+/* Copy "str" to the end of the add buffer and return where it was stored.
+ * Text is never moved once it is in the add buffer.
+ */
+static const char *piece_add_append(struct piece_table *pt, const char *str, int len)
+{
+	struct add_block *b = pt->add;
+	char *s;
+
+	if (!b || b->size - b->used < len) {
+		int size = max(PIECE_ADD_BLOCK_SIZE, len);
+
+		b = malloc(sizeof(struct add_block) + size);
+		if (!b)
+			oom();
+		b->next = pt->add;
+		b->size = size;
+		b->used = 0;
+		pt->add = b;
+	}
+	s = b->data + b->used;
+	memcpy(s, str, len);
+	b->used += len;
+
+	return s;
+}
+
+/* Make room for "n" new pieces at index "i". */
+static void piece_open(struct piece_table *pt, int i, int n)
+{
+	if (pt->n_pieces + n > pt->alloc) {
+		pt->alloc = max(pt->alloc * 2, pt->n_pieces + n);
+		pt->pieces = realloc(pt->pieces, pt->alloc * sizeof(struct piece));
+		if (!pt->pieces)
+			oom();
+	}
+	memmove(pt->pieces + i + n, pt->pieces + i, (pt->n_pieces - i) * sizeof(struct piece));
+	pt->n_pieces += n;
+}
+
+static void piece_close(struct piece_table *pt, int i, int n)
+{
+	memmove(pt->pieces + i, pt->pieces + i + n, (pt->n_pieces - i - n) * sizeof(struct piece));
+	pt->n_pieces -= n;
+}
+
+/* The pieces from index "i" on have moved in the text. They are
+   numbered again when a lookup gets to them. */
+static void piece_moved(struct piece_table *pt, int i)
+{
+	if (pt->numbered > i)
+		pt->numbered = i;
+}
+
+static bool piece_has(struct piece_table *pt, int i, int pos)
+{
+	return i >= 0 && i < pt->numbered &&
+	       pt->pieces[i].pos <= pos && pos < pt->pieces[i].pos + pt->pieces[i].len;
+}
+
+/* Find the piece containing position "pos" and store its position in "start".
+ * The cached piece and its neighbours are tried first, so walking the text
+ * in either direction is O(1) per piece. Otherwise it is a binary search
+ * over the numbered pieces, or numbering more of them up to "pos", which
+ * after an edit costs once what the memmove of the edit did.
+ * Return the piece index, or the number of pieces if "pos" is at the end.
+ */
+static int piece_find(struct piece_table *pt, int pos, int *start)
+{
+	int i = pt->cache_index, p, lo, hi;
+
+	p = pt->numbered > 0 ? pt->pieces[pt->numbered - 1].pos + pt->pieces[pt->numbered - 1].len : 0;
+	if (piece_has(pt, i, pos)) {
+		/* nothing to do */
+	} else if (piece_has(pt, i + 1, pos)) {
+		i++;
+	} else if (piece_has(pt, i - 1, pos)) {
+		i--;
+	} else if (pos < p) {
+		lo = 0;
+		hi = pt->numbered - 1;
+		while (lo < hi) {
+			int mid = lo + (hi - lo + 1) / 2;
+
+			if (pt->pieces[mid].pos <= pos)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		i = lo;
+	} else {
+		for (i = pt->numbered; i < pt->n_pieces; i++) {
+			pt->pieces[i].pos = p;
+			if (p + pt->pieces[i].len > pos)
+				break;
+			p += pt->pieces[i].len;
+		}
+		pt->numbered = min(i + 1, pt->n_pieces);
+		pt->cache_index = i;
+		*start = p;
+		return i;
+	}
+	pt->cache_index = i;
+	*start = pt->pieces[i].pos;
+
+	return i;
+}
+
+/* Point "data" at the text stored from position "pos" on.
+ * Return the number of contiguous bytes, 0 at the end of the text.
+ */
+int piece_table_span(struct piece_table *pt, int pos, const char **data)
+{
+	int i, start;
+
+	i = piece_find(pt, pos, &start);
+	if (i == pt->n_pieces)
+		return 0;
+	*data = pt->pieces[i].data + pos - start;
+
+	return pt->pieces[i].len - (pos - start);
+}
+
+/* Point "data" at the contiguous text that ends right before position "pos".
+ * Return the number of bytes, 0 at the beginning of the text.
+ */
+int piece_table_span_before(struct piece_table *pt, int pos, const char **data)
+{
+	int i, start;
+
+	if (pos <= 0)
+		return 0;
+	i = piece_find(pt, pos - 1, &start);
+	*data = pt->pieces[i].data;
+
+	return pos - start;
+}
+
+char piece_table_byte_at(struct piece_table *pt, int pos)
+{
+	const char *data;
+
+	if (piece_table_span(pt, pos, &data) <= 0)
+		return -1;
+	return *data;
+}
+
+void piece_table_insert(struct piece_table *pt, int pos, const char *str, int len)
+{
+	const char *s;
+	int i, start;
+
+	if (len <= 0)
+		return;
+	s = piece_add_append(pt, str, len);
+	i = piece_find(pt, pos, &start);
+
+	if (pos == start) {
+		struct piece *prev = (i > 0) ? &pt->pieces[i - 1] : NULL;
+
+		/* Typing appends to the add buffer right after the previous
+		   insertion, so the piece in front can usually just grow. */
+		if (prev && prev->data + prev->len == s) {
+			prev->len += len;
+			pt->cache_index = i - 1;
+			piece_moved(pt, i);
+			return;
+		}
+		piece_open(pt, i, 1);
+	} else {
+		struct piece *p;
+
+		/* Split the piece around the insertion. */
+		piece_open(pt, i + 1, 2);
+		p = &pt->pieces[i];
+		p[2].data = p->data + (pos - start);
+		p[2].len = p->len - (pos - start);
+		p->len = pos - start;
+		i++;
+	}
+	pt->pieces[i].data = s;
+	pt->pieces[i].len = len;
+	pt->cache_index = i;
+	piece_moved(pt, i);
+}
+
+void piece_table_delete(struct piece_table *pt, int pos, int n)
+{
+	int i, j, start;
+
+	i = piece_find(pt, pos, &start);
+	if (pos != start) {
+		struct piece *p;
+
+		/* Split so that the deletion begins at a piece boundary. */
+		piece_open(pt, i + 1, 1);
+		p = &pt->pieces[i];
+		p[1].data = p->data + (pos - start);
+		p[1].len = p->len - (pos - start);
+		p->len = pos - start;
+		i++;
+	}
+
+	/* Drop all the pieces covered at once, a memmove per piece would make
+	   deleting many of them quadratic. */
+	for (j = i; j < pt->n_pieces && n >= pt->pieces[j].len; j++)
+		n -= pt->pieces[j].len;
+	piece_close(pt, i, j - i);
+	if (n > 0 && i < pt->n_pieces) {
+		pt->pieces[i].data += n;
+		pt->pieces[i].len -= n;
+	}
+	pt->cache_index = i;
+	piece_moved(pt, i);
+}
@@ -0,0 +1,55 @@
+#pragma once
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+#include <stddef.h>
+
+#define PIECE_ALLOC_CHUNK 64
+#define PIECE_ADD_BLOCK_SIZE (64 * 1024)
+
+/* A piece describes a run of text that lives either in the read-only mapping
+ * of the original file or in one of the append-only add blocks. Neither ever
+ * moves, so pieces can point at the text directly.
+ */
+struct piece {
+	const char *data;
+	int len;
+	/* Position of the first byte in the text. */
+	int pos;
+};
+
+struct add_block {
+	struct add_block *next;
+	int size;
+	int used;
+	char data[];
+};
+
+struct piece_table {
+	char *map;
+	size_t map_len;
+	struct add_block *add;
+	struct piece *pieces;
+	int n_pieces;
+	int alloc;
+	/* The pieces before this one have their "pos" up to date. */
+	int numbered;
+	/* Last looked up piece, makes sequential access cheap. */
+	int cache_index;
+};
+
+struct piece_table *piece_table_new(void);
+struct piece_table *piece_table_map(int fd, size_t len);
+void piece_table_free(struct piece_table *pt);
+void piece_table_clear(struct piece_table *pt);
+int piece_table_span(struct piece_table *pt, int pos, const char **data);
+int piece_table_span_before(struct piece_table *pt, int pos, const char **data);
+char piece_table_byte_at(struct piece_table *pt, int pos);
+void piece_table_insert(struct piece_table *pt, int pos, const char *str, int len);
+void piece_table_delete(struct piece_table *pt, int pos, int n);
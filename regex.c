@@ -0,0 +1,1248 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Regular expressions without backtracking.
+ *
+ * A pattern is parsed into a tree, which is compiled into two Thompson NFAs:
+ * one for the pattern and one for the pattern reversed. Searching runs the
+ * NFAs as DFAs built lazily, one state per set of NFA states, so every byte
+ * of text costs a table lookup once the states it needs exist. The cache of
+ * DFA states is bounded; if a pattern keeps overflowing it, the search goes
+ * on simulating the NFA directly. Either way the time is linear in the text.
+ *
+ * Forward searching finds where the leftmost match ends: the NFA states are
+ * kept in priority order and everything of lower priority than a match is
+ * dropped. Then the reversed NFA is run back from there to find where the
+ * match starts.
+ *
+ * Supported: literals, ".", "[...]", "[^...]", "^", "$", "|", "(...)",
+ * "*", "+", "?", "{n}", "{n,}", "{n,m}", lazy "*?" and friends, and the
+ * escapes \d \D \w \W \s \S \n \t. Matching is byte based; "." doesn't match
+ * a newline, "^" and "$" match at line boundaries.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mini.h"
+#include "parallel.h"
+#include "regex.h"
+#include "search.h"
+
+struct byte_class {
+	uint32_t bits[8];
+};
+
+enum node_type {
+	NODE_EMPTY,
+	NODE_CLASS,
+	NODE_BOL,
+	NODE_EOL,
+	NODE_CONCAT,
+	NODE_ALT,
+	NODE_REPEAT,
+};
+
+struct node {
+	enum node_type type;
+	int a;
+	int b;
+	/* NODE_REPEAT, "max" is -1 if unbounded. */
+	int min;
+	int max;
+	bool greedy;
+	/* NODE_CLASS */
+	int cls;
+};
+
+struct parser {
+	const char *p;
+	const char *end;
+	struct node *nodes;
+	int n_nodes;
+	int alloc_nodes;
+	struct byte_class *classes;
+	int n_classes;
+	int alloc_classes;
+	const char *error;
+};
+
+enum nfa_op {
+	NFA_CLASS,
+	NFA_SPLIT,
+	NFA_BOL,
+	NFA_EOL,
+	NFA_MATCH,
+};
+
+struct nfa_state {
+	enum nfa_op op;
+	int out;
+	int out1;
+	int cls;
+};
+
+struct nfa {
+	struct nfa_state *states;
+	int n;
+	int alloc;
+	int start;
+};
+
+#define DFA_BOL 0x1
+#define DFA_LOOP 0x2
+
+/* A DFA state is an ordered set of NFA states: consuming ones, "$" that
+ * can't be decided before the next byte is seen, and the match state.
+ */
+struct dfa_state {
+	int list;
+	int n;
+	unsigned flags;
+	/* Whether a match ends at the end of the text, -1 if not known yet. */
+	int eof;
+	/* Next state shifted left by one, the low bit set if a match ends right
+	   before the byte; -1 if not known yet. */
+	int next[256];
+};
+
+struct dfa {
+	const struct nfa *nfa;
+	const struct byte_class *classes;
+	/* Keep going after a match to find the longest one. */
+	bool longest;
+	/* Start a new thread at every position. */
+	bool unanchored;
+
+	struct dfa_state *states;
+	int n_states;
+	int *pool;
+	int pool_len;
+	int pool_alloc;
+	int *hash;
+	int start[2];
+	int flushes;
+
+	/* Scratch space, "nfa->n" entries each. */
+	int *set;
+	int set_n;
+	int *tmp;
+	int tmp_n;
+	int *cur;
+	int cur_n;
+	unsigned cur_flags;
+	int *stack;
+	unsigned *mark;
+	unsigned gen;
+	unsigned *mark_pre;
+	unsigned gen_pre;
+};
+
+/* The DFAs a search runs, one pair per searching thread. */
+struct searcher {
+	struct dfa fwd;
+	struct dfa rev;
+};
+
+struct regex {
+	struct byte_class *classes;
+	struct nfa fwd_nfa;
+	struct nfa rev_nfa;
+	struct searcher searcher;
+	/* Every match begins with this literal, if "prefix_len" isn't 0. */
+	char *prefix;
+	int prefix_len;
+	struct search_pattern prefix_pat;
+};
+
+/* Where a DFA scan stands: a cached state, or -1 once the cache overflowed
+ * too often and the NFA state set in "dfa->cur" is advanced directly.
+ */
+struct run {
+	struct dfa *d;
+	int s;
+};
+
+/** Parsing */
+
+static void class_set(struct byte_class *cls, int c)
+{
+	cls->bits[c >> 5] |= 1u << (c & 31);
+}
+
+static bool class_has(const struct byte_class *cls, int c)
+{
+	return cls->bits[c >> 5] & (1u << (c & 31));
+}
+
+static void class_set_range(struct byte_class *cls, int from, int to)
+{
+	int c;
+
+	for (c = from; c <= to; c++)
+		class_set(cls, c);
+}
+
+static void class_invert(struct byte_class *cls)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		cls->bits[i] = ~cls->bits[i];
+}
+
+/* Return the byte if the class holds exactly one, or -1. */
+static int class_single(const struct byte_class *cls)
+{
+	int c, found = -1;
+
+	for (c = 0; c < 256; c++) {
+		if (!class_has(cls, c))
+			continue;
+		if (found >= 0)
+			return -1;
+		found = c;
+	}
+
+	return found;
+}
+
+static int node_new(struct parser *ps, enum node_type type)
+{
+	struct node *n;
+
+	if (ps->n_nodes == ps->alloc_nodes) {
+		ps->alloc_nodes = max(64, ps->alloc_nodes * 2);
+		ps->nodes = realloc(ps->nodes, ps->alloc_nodes * sizeof(struct node));
+		if (!ps->nodes)
+			oom();
+	}
+	n = &ps->nodes[ps->n_nodes];
+	memset(n, 0, sizeof(struct node));
+	n->type = type;
+
+	return ps->n_nodes++;
+}
+
+static int class_new(struct parser *ps)
+{
+	if (ps->n_classes == ps->alloc_classes) {
+		ps->alloc_classes = max(16, ps->alloc_classes * 2);
+		ps->classes = realloc(ps->classes, ps->alloc_classes * sizeof(struct byte_class));
+		if (!ps->classes)
+			oom();
+	}
+	memset(&ps->classes[ps->n_classes], 0, sizeof(struct byte_class));
+
+	return ps->n_classes++;
+}
+
+static int node_class(struct parser *ps, int cls)
+{
+	int n = node_new(ps, NODE_CLASS);
+
+	ps->nodes[n].cls = cls;
+	return n;
+}
+
+static int node_pair(struct parser *ps, enum node_type type, int a, int b)
+{
+	int n = node_new(ps, type);
+
+	ps->nodes[n].a = a;
+	ps->nodes[n].b = b;
+	return n;
+}
+
+/* Add the class of escape "\c" to "cls". Return false if it isn't a class escape. */
+static bool escape_class(struct byte_class *cls, char c)
+{
+	struct byte_class tmp = {{0}};
+	int i;
+
+	switch (c) {
+	case 'd': case 'D':
+		class_set_range(&tmp, '0', '9');
+		break;
+	case 'w': case 'W':
+		class_set_range(&tmp, '0', '9');
+		class_set_range(&tmp, 'a', 'z');
+		class_set_range(&tmp, 'A', 'Z');
+		class_set(&tmp, '_');
+		break;
+	case 's': case 'S':
+		class_set(&tmp, ' ');
+		class_set_range(&tmp, '\t', '\r');
+		break;
+	default:
+		return false;
+	}
+	if (c == 'D' || c == 'W' || c == 'S')
+		class_invert(&tmp);
+	for (i = 0; i < 8; i++)
+		cls->bits[i] |= tmp.bits[i];
+
+	return true;
+}
+
+static unsigned char escape_byte(char c)
+{
+	switch (c) {
+	case 'n':
+		return '\n';
+	case 't':
+		return '\t';
+	default:
+		return c;
+	}
+}
+
+static int parse_alt(struct parser *ps);
+
+static int parse_class(struct parser *ps)
+{
+	int cls = class_new(ps);
+	bool negate = false, first = true;
+
+	if (ps->p < ps->end && *ps->p == '^') {
+		negate = true;
+		ps->p++;
+	}
+	while (ps->p < ps->end && (*ps->p != ']' || first)) {
+		unsigned char c = *ps->p++;
+		unsigned char to;
+
+		first = false;
+		if (c == '\\' && ps->p < ps->end) {
+			c = *ps->p++;
+			if (escape_class(&ps->classes[cls], c))
+				continue;
+			c = escape_byte(c);
+		}
+		if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+			to = ps->p[1];
+			ps->p += 2;
+			if (to == '\\' && ps->p < ps->end)
+				to = escape_byte(*ps->p++);
+			if (to < c) {
+				ps->error = "Invalid range in []";
+				return -1;
+			}
+			class_set_range(&ps->classes[cls], c, to);
+		} else {
+			class_set(&ps->classes[cls], c);
+		}
+	}
+	if (ps->p == ps->end) {
+		ps->error = "Missing ]";
+		return -1;
+	}
+	ps->p++;
+	if (negate)
+		class_invert(&ps->classes[cls]);
+
+	return node_class(ps, cls);
+}
+
+static int parse_atom(struct parser *ps)
+{
+	unsigned char c = *ps->p++;
+	int n, cls;
+
+	switch (c) {
+	case '(':
+		if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':')
+			ps->p += 2;
+		n = parse_alt(ps);
+		if (n < 0)
+			return -1;
+		if (ps->p == ps->end || *ps->p != ')') {
+			ps->error = "Missing )";
+			return -1;
+		}
+		ps->p++;
+		return n;
+	case '[':
+		return parse_class(ps);
+	case '.':
+		cls = class_new(ps);
+		class_set(&ps->classes[cls], '\n');
+		class_invert(&ps->classes[cls]);
+		return node_class(ps, cls);
+	case '^':
+		return node_new(ps, NODE_BOL);
+	case '$':
+		return node_new(ps, NODE_EOL);
+	case '*':
+	case '+':
+	case '?':
+		ps->error = "Nothing to repeat";
+		return -1;
+	case '\\':
+		if (ps->p == ps->end) {
+			ps->error = "Trailing \\";
+			return -1;
+		}
+		c = *ps->p++;
+		cls = class_new(ps);
+		if (!escape_class(&ps->classes[cls], c))
+			class_set(&ps->classes[cls], escape_byte(c));
+		return node_class(ps, cls);
+	default:
+		cls = class_new(ps);
+		class_set(&ps->classes[cls], c);
+		return node_class(ps, cls);
+	}
+}
+
+static bool parse_number(struct parser *ps, int *n)
+{
+	if (ps->p == ps->end || *ps->p < '0' || *ps->p > '9')
+		return false;
+	*n = 0;
+	while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+		*n = *n * 10 + (*ps->p++ - '0');
+		if (*n > REGEX_MAX_REPEAT)
+			*n = REGEX_MAX_REPEAT + 1;
+	}
+
+	return true;
+}
+
+/* Parse "{n}", "{n,}" or "{n,m}". Anything else is left alone and "{" taken
+ * literally.
+ */
+static bool parse_bounds(struct parser *ps, int *min, int *max)
+{
+	const char *start = ps->p;
+
+	ps->p++;
+	if (!parse_number(ps, min))
+		goto literal;
+	*max = *min;
+	if (ps->p < ps->end && *ps->p == ',') {
+		ps->p++;
+		if (!parse_number(ps, max))
+			*max = -1;
+	}
+	if (ps->p == ps->end || *ps->p != '}')
+		goto literal;
+	ps->p++;
+
+	return true;
+literal:
+	ps->p = start;
+	return false;
+}
+
+static int parse_repeat(struct parser *ps)
+{
+	int n, min, max;
+
+	n = parse_atom(ps);
+	while (n >= 0 && ps->p < ps->end) {
+		int r;
+
+		if (*ps->p == '*') {
+			min = 0;
+			max = -1;
+			ps->p++;
+		} else if (*ps->p == '+') {
+			min = 1;
+			max = -1;
+			ps->p++;
+		} else if (*ps->p == '?') {
+			min = 0;
+			max = 1;
+			ps->p++;
+		} else if (*ps->p != '{' || !parse_bounds(ps, &min, &max)) {
+			break;
+		}
+		if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT || (max >= 0 && max < min)) {
+			ps->error = "Invalid repetition";
+			return -1;
+		}
+		r = node_pair(ps, NODE_REPEAT, n, 0);
+		ps->nodes[r].min = min;
+		ps->nodes[r].max = max;
+		ps->nodes[r].greedy = true;
+		if (ps->p < ps->end && *ps->p == '?') {
+			ps->nodes[r].greedy = false;
+			ps->p++;
+		}
+		n = r;
+	}
+
+	return n;
+}
+
+static int parse_concat(struct parser *ps)
+{
+	int n = -1;
+
+	while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+		int a = parse_repeat(ps);
+
+		if (a < 0)
+			return -1;
+		n = (n < 0) ? a : node_pair(ps, NODE_CONCAT, n, a);
+	}
+
+	return (n < 0) ? node_new(ps, NODE_EMPTY) : n;
+}
+
+static int parse_alt(struct parser *ps)
+{
+	int n;
+
+	n = parse_concat(ps);
+	while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+		int b;
+
+		ps->p++;
+		b = parse_concat(ps);
+		if (b < 0)
+			return -1;
+		n = node_pair(ps, NODE_ALT, n, b);
+	}
+
+	return n;
+}
+
+/* Collect the literal bytes every match has to begin with. */
+static bool literal_prefix(struct parser *ps, int node, char *prefix, int *len)
+{
+	struct node *n = &ps->nodes[node];
+	int c;
+
+	switch (n->type) {
+	case NODE_CONCAT:
+		return literal_prefix(ps, n->a, prefix, len) && literal_prefix(ps, n->b, prefix, len);
+	case NODE_CLASS:
+		c = class_single(&ps->classes[n->cls]);
+		if (c < 0)
+			return false;
+		prefix[(*len)++] = c;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/** NFA */
+
+static int nfa_new(struct nfa *nfa, enum nfa_op op, int out)
+{
+	struct nfa_state *s;
+
+	if (nfa->n == REGEX_MAX_NFA)
+		return -1;
+	if (nfa->n == nfa->alloc) {
+		nfa->alloc = max(64, nfa->alloc * 2);
+		nfa->states = realloc(nfa->states, nfa->alloc * sizeof(struct nfa_state));
+		if (!nfa->states)
+			oom();
+	}
+	s = &nfa->states[nfa->n];
+	s->op = op;
+	s->out = out;
+	s->out1 = -1;
+	s->cls = -1;
+
+	return nfa->n++;
+}
+
+/* Emit states for "node" followed by state "next" and return the first one,
+ * or -1 if there are too many. The reversed NFA matches the reversed text.
+ */
+static int nfa_emit(struct nfa *nfa, const struct parser *ps, int node, int next, bool reverse)
+{
+	const struct node *n = &ps->nodes[node];
+	int s, body, i;
+
+	if (next < 0)
+		return -1;
+
+	switch (n->type) {
+	case NODE_EMPTY:
+		return next;
+	case NODE_CLASS:
+		s = nfa_new(nfa, NFA_CLASS, next);
+		if (s >= 0)
+			nfa->states[s].cls = n->cls;
+		return s;
+	case NODE_BOL:
+		return nfa_new(nfa, reverse ? NFA_EOL : NFA_BOL, next);
+	case NODE_EOL:
+		return nfa_new(nfa, reverse ? NFA_BOL : NFA_EOL, next);
+	case NODE_CONCAT:
+		if (reverse)
+			return nfa_emit(nfa, ps, n->b, nfa_emit(nfa, ps, n->a, next, reverse), reverse);
+		return nfa_emit(nfa, ps, n->a, nfa_emit(nfa, ps, n->b, next, reverse), reverse);
+	case NODE_ALT:
+		s = nfa_new(nfa, NFA_SPLIT, -1);
+		if (s < 0)
+			return -1;
+		body = nfa_emit(nfa, ps, n->a, next, reverse);
+		nfa->states[s].out = body;
+		body = nfa_emit(nfa, ps, n->b, next, reverse);
+		nfa->states[s].out1 = body;
+		return (nfa->states[s].out < 0 || body < 0) ? -1 : s;
+	case NODE_REPEAT:
+		break;
+	}
+
+	/* Optional repetitions go last, each one either matches "a" again or
+	   skips all the rest; the required ones are chained in front. */
+	if (n->max < 0) {
+		s = nfa_new(nfa, NFA_SPLIT, -1);
+		if (s < 0)
+			return -1;
+		body = nfa_emit(nfa, ps, n->a, s, reverse);
+		if (body < 0)
+			return -1;
+		nfa->states[s].out = n->greedy ? body : next;
+		nfa->states[s].out1 = n->greedy ? next : body;
+		next = s;
+	} else {
+		int tail = next;
+
+		for (i = n->min; i < n->max; i++) {
+			s = nfa_new(nfa, NFA_SPLIT, -1);
+			if (s < 0)
+				return -1;
+			body = nfa_emit(nfa, ps, n->a, tail, reverse);
+			if (body < 0)
+				return -1;
+			nfa->states[s].out = n->greedy ? body : next;
+			nfa->states[s].out1 = n->greedy ? next : body;
+			tail = s;
+		}
+		next = tail;
+	}
+	for (i = 0; i < n->min; i++)
+		next = nfa_emit(nfa, ps, n->a, next, reverse);
+
+	return next;
+}
+
+/** DFA */
+
+static void dfa_init(struct dfa *d, const struct nfa *nfa, const struct byte_class *classes,
+		     bool unanchored, bool longest)
+{
+	int n = nfa->n;
+
+	memset(d, 0, sizeof(struct dfa));
+	d->nfa = nfa;
+	d->classes = classes;
+	d->unanchored = unanchored;
+	d->longest = longest;
+	d->states = malloc(REGEX_CACHE_STATES * sizeof(struct dfa_state));
+	d->hash = malloc(2 * REGEX_CACHE_STATES * sizeof(int));
+	d->set = malloc(n * sizeof(int));
+	d->tmp = malloc(n * sizeof(int));
+	d->cur = malloc(n * sizeof(int));
+	d->stack = malloc((2 * n + 2) * sizeof(int));
+	d->pool_alloc = 1024;
+	d->pool = malloc(d->pool_alloc * sizeof(int));
+	d->mark = calloc(n, sizeof(unsigned));
+	d->mark_pre = calloc(n, sizeof(unsigned));
+	if (!d->states || !d->hash || !d->set || !d->tmp || !d->cur ||
+	    !d->stack || !d->pool || !d->mark || !d->mark_pre)
+		oom();
+	d->n_states = 0;
+	memset(d->hash, -1, 2 * REGEX_CACHE_STATES * sizeof(int));
+	d->start[0] = -1;
+	d->start[1] = -1;
+}
+
+static void dfa_free(struct dfa *d)
+{
+	free(d->states);
+	free(d->hash);
+	free(d->pool);
+	free(d->set);
+	free(d->tmp);
+	free(d->cur);
+	free(d->stack);
+	free(d->mark);
+	free(d->mark_pre);
+}
+
+static void dfa_flush(struct dfa *d)
+{
+	d->n_states = 0;
+	d->pool_len = 0;
+	memset(d->hash, -1, 2 * REGEX_CACHE_STATES * sizeof(int));
+	d->start[0] = -1;
+	d->start[1] = -1;
+}
+
+/* Add the states reachable from NFA state "s" without consuming anything to
+ * "list", in priority order. "$" is followed only if "eol" is set, and kept
+ * in the list otherwise to be decided by the next byte.
+ */
+static void closure(struct dfa *d, int s, bool bol, bool eol, int *list, int *n,
+		    unsigned *mark, unsigned gen)
+{
+	int top = 0;
+
+	d->stack[top++] = s;
+	while (top > 0) {
+		const struct nfa_state *q;
+
+		s = d->stack[--top];
+		if (mark[s] == gen)
+			continue;
+		mark[s] = gen;
+		q = &d->nfa->states[s];
+		switch (q->op) {
+		case NFA_SPLIT:
+			d->stack[top++] = q->out1;
+			d->stack[top++] = q->out;
+			break;
+		case NFA_BOL:
+			if (bol)
+				d->stack[top++] = q->out;
+			break;
+		case NFA_EOL:
+			if (eol)
+				d->stack[top++] = q->out;
+			else
+				list[(*n)++] = s;
+			break;
+		case NFA_CLASS:
+		case NFA_MATCH:
+			list[(*n)++] = s;
+			break;
+		}
+	}
+}
+
+/* Move NFA state "s" over byte "c" into "d->set". Return true if it is the match state. */
+static bool dfa_consume(struct dfa *d, int s, int c, bool bol)
+{
+	const struct nfa_state *q = &d->nfa->states[s];
+
+	if (q->op == NFA_MATCH)
+		return true;
+	if (q->op == NFA_CLASS && c >= 0 && class_has(&d->classes[q->cls], c))
+		closure(d, q->out, bol, false, d->set, &d->set_n, d->mark, d->gen);
+
+	return false;
+}
+
+/* Advance the NFA states in "list" over byte "c", or to the end of the text
+ * if "c" is -1. The new states go to "d->set" and "out_flags".
+ * Return true if a match ends before "c".
+ */
+static bool dfa_advance(struct dfa *d, const int *list, int n, unsigned flags, int c,
+			unsigned *out_flags)
+{
+	bool bol = (c == '\n'), matched = false;
+	int i, j;
+
+	d->set_n = 0;
+	d->gen++;
+	d->gen_pre++;
+	*out_flags = bol ? DFA_BOL : 0;
+	for (i = 0; i < n && (d->longest || !matched); i++) {
+		if (d->nfa->states[list[i]].op != NFA_EOL) {
+			matched |= dfa_consume(d, list[i], c, bol);
+			continue;
+		}
+		if (c >= 0 && c != '\n')
+			continue;
+		/* "$" holds here, follow it before moving on. */
+		d->tmp_n = 0;
+		closure(d, d->nfa->states[list[i]].out, flags & DFA_BOL, true,
+			d->tmp, &d->tmp_n, d->mark_pre, d->gen_pre);
+		for (j = 0; j < d->tmp_n && (d->longest || !matched); j++)
+			matched |= dfa_consume(d, d->tmp[j], c, bol);
+	}
+	/* Threads starting later have the lowest priority, and none start once
+	   a match is found. */
+	if ((flags & DFA_LOOP) && !matched && c >= 0) {
+		closure(d, d->nfa->start, bol, false, d->set, &d->set_n, d->mark, d->gen);
+		*out_flags |= DFA_LOOP;
+	}
+
+	return matched;
+}
+
+static unsigned dfa_hash(const int *list, int n, unsigned flags)
+{
+	unsigned h = 2166136261u ^ flags;
+	int i;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ list[i]) * 16777619u;
+	return h;
+}
+
+/* Find or add the DFA state for "list". Return -1 if the cache is full. */
+static int dfa_add(struct dfa *d, const int *list, int n, unsigned flags)
+{
+	struct dfa_state *st;
+	unsigned h, mask = 2 * REGEX_CACHE_STATES - 1;
+	int s;
+
+	for (h = dfa_hash(list, n, flags) & mask; d->hash[h] >= 0; h = (h + 1) & mask) {
+		st = &d->states[d->hash[h]];
+		if (st->n == n && st->flags == flags && !memcmp(d->pool + st->list, list, n * sizeof(int)))
+			return d->hash[h];
+	}
+	if (d->n_states == REGEX_CACHE_STATES)
+		return -1;
+
+	if (d->pool_len + n > d->pool_alloc) {
+		d->pool_alloc = max(d->pool_alloc * 2, d->pool_len + n + 1024);
+		d->pool = realloc(d->pool, d->pool_alloc * sizeof(int));
+		if (!d->pool)
+			oom();
+	}
+	s = d->n_states++;
+	st = &d->states[s];
+	st->list = d->pool_len;
+	st->n = n;
+	st->flags = flags;
+	st->eof = -1;
+	memset(st->next, -1, sizeof(st->next));
+	memcpy(d->pool + d->pool_len, list, n * sizeof(int));
+	d->pool_len += n;
+	d->hash[h] = s;
+
+	return s;
+}
+
+/* Compute the transition of state "s" over byte "c". Return -1 if the cache is full. */
+static int dfa_next(struct dfa *d, int s, int c)
+{
+	struct dfa_state *st = &d->states[s];
+	unsigned flags;
+	bool matched;
+	int t;
+
+	matched = dfa_advance(d, d->pool + st->list, st->n, st->flags, c, &flags);
+	t = dfa_add(d, d->set, d->set_n, flags);
+	if (t < 0)
+		return -1;
+	st->next[c] = t << 1 | matched;
+
+	return st->next[c];
+}
+
+/* Copy the current state of a scan to "d->cur". */
+static void run_save(struct run *r)
+{
+	struct dfa *d = r->d;
+	struct dfa_state *st = &d->states[r->s];
+
+	memcpy(d->cur, d->pool + st->list, st->n * sizeof(int));
+	d->cur_n = st->n;
+	d->cur_flags = st->flags;
+}
+
+/* Switch to the state in "d->cur", flushing the cache if it is full or
+ * "flush" is set. Once it has been flushed too often, stay with the NFA
+ * state set.
+ */
+static void run_restore(struct run *r, bool flush)
+{
+	struct dfa *d = r->d;
+
+	r->s = -1;
+	if (d->flushes > REGEX_MAX_FLUSHES)
+		return;
+	if (!flush) {
+		r->s = dfa_add(d, d->cur, d->cur_n, d->cur_flags);
+		if (r->s >= 0)
+			return;
+	}
+	if (++d->flushes > REGEX_MAX_FLUSHES)
+		return;
+	dfa_flush(d);
+	r->s = dfa_add(d, d->cur, d->cur_n, d->cur_flags);
+}
+
+static void run_start(struct run *r, struct dfa *d, bool bol)
+{
+	r->d = d;
+	r->s = (d->flushes > REGEX_MAX_FLUSHES) ? -1 : d->start[bol];
+	if (r->s >= 0)
+		return;
+
+	d->cur_n = 0;
+	d->gen++;
+	closure(d, d->nfa->start, bol, false, d->cur, &d->cur_n, d->mark, d->gen);
+	d->cur_flags = (bol ? DFA_BOL : 0) | (d->unanchored ? DFA_LOOP : 0);
+	run_restore(r, false);
+	if (r->s >= 0)
+		d->start[bol] = r->s;
+}
+
+/* Advance the scan over byte "c". Return true if a match ends before it. */
+static bool run_step(struct run *r, int c)
+{
+	struct dfa *d = r->d;
+	unsigned flags;
+	bool matched;
+	int *swap;
+	int t;
+
+	if (r->s >= 0) {
+		t = d->states[r->s].next[c];
+		if (t < 0)
+			t = dfa_next(d, r->s, c);
+		if (t < 0) {
+			/* The cache is full, start over with just this state. */
+			run_save(r);
+			run_restore(r, true);
+			if (r->s >= 0)
+				t = dfa_next(d, r->s, c);
+		}
+		if (t >= 0) {
+			r->s = t >> 1;
+			return t & 1;
+		}
+		r->s = -1;
+	}
+
+	matched = dfa_advance(d, d->cur, d->cur_n, d->cur_flags, c, &flags);
+	swap = d->cur;
+	d->cur = d->set;
+	d->set = swap;
+	d->cur_n = d->set_n;
+	d->cur_flags = flags;
+
+	return matched;
+}
+
+/* Return true if a match ends at the end of the text. */
+static bool run_eof(struct run *r)
+{
+	struct dfa *d = r->d;
+	struct dfa_state *st;
+	unsigned flags;
+
+	if (r->s < 0)
+		return dfa_advance(d, d->cur, d->cur_n, d->cur_flags, -1, &flags);
+
+	st = &d->states[r->s];
+	if (st->eof < 0)
+		st->eof = dfa_advance(d, d->pool + st->list, st->n, st->flags, -1, &flags);
+	return st->eof;
+}
+
+/* Return true if no match can be found any more. */
+static bool run_dead(struct run *r)
+{
+	struct dfa *d = r->d;
+
+	if (r->s < 0)
+		return d->cur_n == 0 && !(d->cur_flags & DFA_LOOP);
+	return d->states[r->s].n == 0 && !(d->states[r->s].flags & DFA_LOOP);
+}
+
+/* Stop starting new threads. */
+static void run_stop_starting(struct run *r)
+{
+	if (r->s >= 0)
+		run_save(r);
+	r->d->cur_flags &= ~DFA_LOOP;
+	run_restore(r, false);
+}
+
+static bool is_bol(struct buffer *buf, int pos)
+{
+	return pos == 0 || buffer_data_at(buf, pos - 1) == '\n';
+}
+
+/** Searching */
+
+/* Find the end of the leftmost match that begins at "from" or later, but
+ * before "limit". The text isn't read past "stop", a match running on past
+ * it ends there. Return -1 if there is none.
+ */
+static int scan_forward(struct regex *re, struct searcher *sr, struct buffer *buf, int from,
+			int limit, int stop)
+{
+	struct dfa *d = &sr->fwd;
+	struct span sp;
+	struct run r;
+	int p, i, end = -1, jumps = 0, skipped = 0;
+	bool starting = true, prefilter = re->prefix_len > 0;
+
+	d->flushes = 0;
+	p = from;
+restart:
+	run_start(&r, d, is_bol(buf, p));
+	for (; buffer_span_forward(buf, p, stop, &sp); p += sp.len) {
+		for (i = 0; i < sp.len; i++) {
+			int pos;
+
+			/* Follow cached transitions for as long as nothing else
+			   needs to be done: no match, no limit, no prefix to find. */
+			if (starting && end < 0 && r.s >= 0) {
+				const struct dfa_state *st = d->states;
+				int last = min(sp.len, limit - 1 - sp.pos);
+				int s0 = prefilter ? d->start[0] : -1;
+				int s1 = prefilter ? d->start[1] : -1;
+				int s = r.s, t;
+
+				while (i < last && s != s0 && s != s1) {
+					t = st[s].next[(unsigned char)sp.data[i]];
+					if (t < 0 || (t & 1))
+						break;
+					s = t >> 1;
+					i++;
+				}
+				r.s = s;
+				if (i == sp.len)
+					break;
+			}
+			pos = sp.pos + i;
+			/* The step over this byte starts a thread after it. */
+			if (starting && pos + 1 >= limit) {
+				run_stop_starting(&r);
+				starting = false;
+			}
+			/* Nothing is under way: skip to where the literal prefix is,
+			   unless it is so common that skipping doesn't pay off. */
+			if (starting && prefilter &&
+			    (r.s == d->start[0] || r.s == d->start[1]) && r.s >= 0) {
+				int q = search_range(buf, &re->prefix_pat, pos,
+						     min(limit + re->prefix_len - 1, stop));
+
+				if (q < 0 || q >= limit)
+					return -1;
+				skipped += q - pos;
+				if (++jumps >= REGEX_PREFILTER_MIN_JUMPS &&
+				    skipped < jumps * REGEX_PREFILTER_MIN_SKIP)
+					prefilter = false;
+				if (q > pos) {
+					p = q;
+					goto restart;
+				}
+			}
+			if (run_step(&r, (unsigned char)sp.data[i]))
+				end = pos;
+			if (run_dead(&r))
+				return end;
+		}
+	}
+	if (stop >= buf->used && run_eof(&r))
+		end = buf->used;
+
+	return end;
+}
+
+/* Find where the leftmost match ending at "end" begins, not before "from". */
+static int scan_reverse(struct searcher *sr, struct buffer *buf, int from, int end)
+{
+	struct dfa *d = &sr->rev;
+	struct span sp;
+	struct run r;
+	int p, i, start = end;
+
+	d->flushes = 0;
+	run_start(&r, d, end == buf->used || buffer_data_at(buf, end) == '\n');
+	for (p = end; buffer_span_backward(buf, p, from, &sp); p -= sp.len) {
+		for (i = sp.len - 1; i >= 0; i--) {
+			if (run_step(&r, (unsigned char)sp.data[i]))
+				start = sp.pos + i + 1;
+			if (run_dead(&r))
+				return start;
+		}
+	}
+	if (from > 0 ? run_step(&r, (unsigned char)buffer_data_at(buf, from - 1)) : run_eof(&r))
+		start = from;
+
+	return start;
+}
+
+static int search_until(struct regex *re, struct searcher *sr, struct buffer *buf, int from,
+			int limit, int stop, int *end)
+{
+	int e;
+
+	if (from >= limit || from > buf->used)
+		return -1;
+	e = scan_forward(re, sr, buf, from, limit, stop);
+	if (e < 0)
+		return -1;
+	*end = e;
+
+	return scan_reverse(sr, buf, from, e);
+}
+
+static void searcher_init(struct searcher *sr, struct regex *re)
+{
+	dfa_init(&sr->fwd, &re->fwd_nfa, re->classes, true, false);
+	dfa_init(&sr->rev, &re->rev_nfa, re->classes, false, true);
+}
+
+static void searcher_free(struct searcher *sr)
+{
+	dfa_free(&sr->fwd);
+	dfa_free(&sr->rev);
+}
+
+struct chunk_search {
+	struct regex *re;
+	/* For every thread but the first one, which uses the regex's own. */
+	struct searcher *searchers;
+};
+
+/* Search a chunk of the text. Matches may run on past its end. */
+static int search_chunk(struct buffer *buf, int beg, int end, int thread, void *arg,
+			int *match_end)
+{
+	struct chunk_search *cs = arg;
+	struct searcher *sr = thread ? &cs->searchers[thread - 1] : &cs->re->searcher;
+
+	return search_until(cs->re, sr, buf, beg, end, buf->used, match_end);
+}
+
+/* Find the leftmost match that begins at "from" or later. A large buffer is
+ * searched with several threads.
+ * Return its position and its end in "end", or -1 if not found.
+ */
+int regex_search_forward(struct regex *re, struct buffer *buf, int from, int *end)
+{
+	struct chunk_search cs;
+	int i, n, p;
+
+	from = max(from, 0);
+	n = parallel_threads(buf, from);
+	if (n == 1)
+		return search_until(re, &re->searcher, buf, from, buf->used + 1, buf->used, end);
+
+	cs.re = re;
+	cs.searchers = malloc((n - 1) * sizeof(struct searcher));
+	if (!cs.searchers)
+		oom();
+	for (i = 0; i < n - 1; i++)
+		searcher_init(&cs.searchers[i], re);
+	p = parallel_search(buf, from, n, search_chunk, &cs, end);
+	for (i = 0; i < n - 1; i++)
+		searcher_free(&cs.searchers[i]);
+	free(cs.searchers);
+
+	return p;
+}
+
+/* Find the leftmost match that begins at "from" or later, but before "limit".
+ * Return its position and its end in "end", or -1 if not found.
+ */
+int regex_search_range(struct regex *re, struct buffer *buf, int from, int limit, int *end)
+{
+	return search_until(re, &re->searcher, buf, max(from, 0), min(limit, buf->used + 1),
+			    buf->used, end);
+}
+
+/* Like regex_search_range(), but read no text past "stop". A match that
+ * would run on past it is cut short, for work that must stay bounded like
+ * highlighting what is on screen.
+ */
+int regex_search_bounded(struct regex *re, struct buffer *buf, int from, int limit, int stop,
+			 int *end)
+{
+	stop = min(stop, buf->used);
+	return search_until(re, &re->searcher, buf, max(from, 0), min(limit, stop + 1), stop, end);
+}
+
+/* Find the last match that begins before "from".
+ * Matches are taken in the order searching forward would find them, starting
+ * at a line at least REGEX_WINDOW bytes back; the window doubles until it
+ * has a match.
+ * Return its position and its end in "end", or -1 if not found.
+ */
+int regex_search_backward(struct regex *re, struct buffer *buf, int from, int *end)
+{
+	int window, lo, p, s, e, found = -1;
+
+	from = min(from, buf->used + 1);
+	for (window = REGEX_WINDOW; ; ) {
+		lo = buffer_get_next_newline(buf, max(0, from - window), -1) + 1;
+		for (p = lo; (s = search_until(re, &re->searcher, buf, p, from, buf->used, &e)) >= 0; ) {
+			found = s;
+			*end = e;
+			p = (e > s) ? e : s + 1;
+		}
+		if (found >= 0 || lo == 0)
+			return found;
+		window = (window > from / 2) ? from : window * 2;
+	}
+}
+
+/* Compile "pattern" of length "len".
+ * Return NULL and a message in "error" if the pattern is invalid.
+ */
+struct regex *regex_compile(const char *pattern, int len, const char **error)
+{
+	struct parser ps = {0};
+	struct regex *re;
+	int root, match;
+
+	ps.p = pattern;
+	ps.end = pattern + len;
+	root = parse_alt(&ps);
+	if (root >= 0 && ps.p != ps.end) {
+		ps.error = "Unmatched )";
+		root = -1;
+	}
+	if (root < 0)
+		goto fail;
+
+	re = calloc(1, sizeof(struct regex));
+	if (!re)
+		oom();
+	re->classes = ps.classes;
+
+	match = nfa_new(&re->fwd_nfa, NFA_MATCH, -1);
+	re->fwd_nfa.start = nfa_emit(&re->fwd_nfa, &ps, root, match, false);
+	match = nfa_new(&re->rev_nfa, NFA_MATCH, -1);
+	re->rev_nfa.start = nfa_emit(&re->rev_nfa, &ps, root, match, true);
+	if (re->fwd_nfa.start < 0 || re->rev_nfa.start < 0) {
+		ps.error = "Pattern too large";
+		ps.classes = NULL;
+		regex_free(re);
+		goto fail;
+	}
+	searcher_init(&re->searcher, re);
+
+	re->prefix = malloc(len + 1);
+	if (!re->prefix)
+		oom();
+	literal_prefix(&ps, root, re->prefix, &re->prefix_len);
+	search_init(&re->prefix_pat, re->prefix, re->prefix_len);
+	free(ps.nodes);
+
+	return re;
+fail:
+	*error = ps.error;
+	free(ps.nodes);
+	free(ps.classes);
+	return NULL;
+}
+
+void regex_free(struct regex *re)
+{
+	if (re->searcher.fwd.states)
+		searcher_free(&re->searcher);
+	free(re->fwd_nfa.states);
+	free(re->rev_nfa.states);
+	free(re->classes);
+	free(re->prefix);
+	free(re);
+}
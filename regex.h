@@ -0,0 +1,35 @@
+#pragma once
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Limits that keep compiling and matching bounded for any pattern. */
+#define REGEX_MAX_NFA 10000
+#define REGEX_MAX_REPEAT 1000
+/* Number of DFA states cached before the cache is flushed, a power of two. */
+#define REGEX_CACHE_STATES 512
+/* After this many flushes in one search, stop caching and simulate the NFA. */
+#define REGEX_MAX_FLUSHES 8
+/* The literal prefix of a pattern is searched for on its own, unless after
+ * this many times it turns out to skip less than MIN_SKIP bytes on average.
+ */
+#define REGEX_PREFILTER_MIN_JUMPS 64
+#define REGEX_PREFILTER_MIN_SKIP 256
+/* Searching backward looks at windows of text this large, doubling. */
+#define REGEX_WINDOW (64 * 1024)
+
+struct buffer;
+struct regex;
+
+struct regex *regex_compile(const char *pattern, int len, const char **error);
+void regex_free(struct regex *re);
+int regex_search_forward(struct regex *re, struct buffer *buf, int from, int *end);
+int regex_search_range(struct regex *re, struct buffer *buf, int from, int limit, int *end);
+int regex_search_bounded(struct regex *re, struct buffer *buf, int from, int limit, int stop,
+			 int *end);
+int regex_search_backward(struct regex *re, struct buffer *buf, int from, int *end);
@@ -0,0 +1,553 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mini.h"
+#include "newline.h"
+#include "rope.h"
+
+static bool is_leaf(struct rope_node *node)
+{
+	return node->data != NULL;
+}
+
+static struct rope_node *rope_leaf_new(void)
+{
+	struct rope_node *leaf;
+
+	leaf = calloc(1, sizeof(struct rope_node));
+	if (!leaf)
+		oom();
+	leaf->data = malloc(ROPE_LEAF_SIZE);
+	if (!leaf->data)
+		oom();
+	leaf->gap_end = ROPE_LEAF_SIZE;
+
+	return leaf;
+}
+
+static struct rope_node *rope_inner_new(void)
+{
+	struct rope_node *node;
+
+	node = calloc(1, sizeof(struct rope_node));
+	if (!node)
+		oom();
+
+	return node;
+}
+
+static void rope_node_free(struct rope_node *node)
+{
+	int i;
+
+	for (i = 0; i < node->n_children; i++)
+		rope_node_free(node->children[i]);
+	free(node->data);
+	free(node);
+}
+
+/* Recompute the cached counts of an inner node from its children. */
+static void rope_node_update(struct rope_node *node)
+{
+	int i;
+
+	node->bytes = 0;
+	node->newlines = 0;
+	for (i = 0; i < node->n_children; i++) {
+		node->bytes += node->children[i]->bytes;
+		node->newlines += node->children[i]->newlines;
+	}
+}
+
+/* Count newlines between leaf offsets "from" and "to". */
+static int leaf_newlines(struct rope_node *leaf, int from, int to)
+{
+	int nl = 0, gap = leaf->gap_end - leaf->gap_start;
+
+	if (from < leaf->gap_start)
+		nl += newline_count(leaf->data + from, min(to, leaf->gap_start) - from);
+	if (to > leaf->gap_start) {
+		from = max(from, leaf->gap_start);
+		nl += newline_count(leaf->data + from + gap, to - from);
+	}
+
+	return nl;
+}
+
+static void leaf_move_gap(struct rope_node *leaf, int off)
+{
+	int n;
+
+	if (off < leaf->gap_start) {
+		n = leaf->gap_start - off;
+		memmove(leaf->data + leaf->gap_end - n, leaf->data + off, n);
+		leaf->gap_start -= n;
+		leaf->gap_end -= n;
+	} else if (off > leaf->gap_start) {
+		n = off - leaf->gap_start;
+		memmove(leaf->data + leaf->gap_start, leaf->data + leaf->gap_end, n);
+		leaf->gap_start += n;
+		leaf->gap_end += n;
+	}
+}
+
+static void leaf_insert(struct rope_node *leaf, int off, const char *str, int len)
+{
+	leaf_move_gap(leaf, off);
+	memcpy(leaf->data + leaf->gap_start, str, len);
+	leaf->gap_start += len;
+	leaf->bytes += len;
+	leaf->newlines += newline_count(str, len);
+}
+
+static void leaf_delete(struct rope_node *leaf, int off, int n)
+{
+	leaf->newlines -= leaf_newlines(leaf, off, off + n);
+	leaf_move_gap(leaf, off);
+	leaf->gap_end += n;
+	leaf->bytes -= n;
+}
+
+/* Move the upper half of a full leaf into a new leaf and return it. */
+static struct rope_node *leaf_split(struct rope_node *leaf)
+{
+	struct rope_node *right;
+	int n;
+
+	right = rope_leaf_new();
+	leaf_move_gap(leaf, leaf->bytes / 2);
+	n = ROPE_LEAF_SIZE - leaf->gap_end;
+	memcpy(right->data, leaf->data + leaf->gap_end, n);
+	right->gap_start = n;
+	right->bytes = n;
+	right->newlines = newline_count(right->data, n);
+	leaf->gap_end = ROPE_LEAF_SIZE;
+	leaf->bytes -= n;
+	leaf->newlines -= right->newlines;
+
+	return right;
+}
+
+/* Move the upper half of an overflowing inner node into a new node and return it. */
+static struct rope_node *inner_split(struct rope_node *node)
+{
+	struct rope_node *right;
+	int half = node->n_children / 2;
+
+	right = rope_inner_new();
+	right->n_children = node->n_children - half;
+	memcpy(right->children, node->children + half, right->n_children * sizeof(struct rope_node *));
+	node->n_children = half;
+	rope_node_update(node);
+	rope_node_update(right);
+
+	return right;
+}
+
+/* Insert at most ROPE_LEAF_SIZE / 2 bytes into the subtree.
+ * Return the new right sibling if the node had to be split, or NULL.
+ */
+static struct rope_node *node_insert(struct rope_node *node, int pos, const char *str, int len)
+{
+	struct rope_node *child, *split;
+	int i;
+
+	if (is_leaf(node)) {
+		if (node->bytes + len <= ROPE_LEAF_SIZE) {
+			leaf_insert(node, pos, str, len);
+			return NULL;
+		}
+		split = leaf_split(node);
+		if (pos <= node->bytes)
+			leaf_insert(node, pos, str, len);
+		else
+			leaf_insert(split, pos - node->bytes, str, len);
+		return split;
+	}
+
+	for (i = 0; i < node->n_children - 1; i++) {
+		if (pos <= node->children[i]->bytes)
+			break;
+		pos -= node->children[i]->bytes;
+	}
+	child = node->children[i];
+	split = node_insert(child, pos, str, len);
+	if (!split) {
+		node->bytes += len;
+		node->newlines += newline_count(str, len);
+		return NULL;
+	}
+
+	memmove(node->children + i + 2, node->children + i + 1,
+		(node->n_children - i - 1) * sizeof(struct rope_node *));
+	node->children[i + 1] = split;
+	node->n_children++;
+	if (node->n_children > ROPE_FANOUT)
+		return inner_split(node);
+	rope_node_update(node);
+
+	return NULL;
+}
+
+/* Merge child "i" with its right neighbour if they fit into one node.
+ * Return true if they were merged.
+ */
+static bool node_merge(struct rope_node *node, int i)
+{
+	struct rope_node *a = node->children[i], *b = node->children[i + 1];
+
+	if (is_leaf(a)) {
+		int gap = b->gap_end - b->gap_start;
+
+		if (a->bytes + b->bytes > ROPE_LEAF_SIZE / 2)
+			return false;
+		leaf_move_gap(a, a->bytes);
+		memcpy(a->data + a->gap_start, b->data, b->gap_start);
+		memcpy(a->data + a->gap_start + b->gap_start, b->data + b->gap_start + gap,
+		       b->bytes - b->gap_start);
+		a->gap_start += b->bytes;
+		a->bytes += b->bytes;
+		a->newlines += b->newlines;
+	} else {
+		if (a->n_children + b->n_children > ROPE_FANOUT)
+			return false;
+		memcpy(a->children + a->n_children, b->children, b->n_children * sizeof(struct rope_node *));
+		a->n_children += b->n_children;
+		b->n_children = 0;
+		rope_node_update(a);
+	}
+	rope_node_free(b);
+	memmove(node->children + i + 1, node->children + i + 2,
+		(node->n_children - i - 2) * sizeof(struct rope_node *));
+	node->n_children--;
+
+	return true;
+}
+
+static void node_delete(struct rope_node *node, int pos, int n)
+{
+	int i = 0;
+
+	if (is_leaf(node)) {
+		leaf_delete(node, pos, n);
+		return;
+	}
+
+	while (n > 0 && i < node->n_children) {
+		struct rope_node *child = node->children[i];
+		int k;
+
+		if (pos >= child->bytes) {
+			pos -= child->bytes;
+			i++;
+			continue;
+		}
+		k = min(n, child->bytes - pos);
+		if (k == child->bytes) {
+			rope_node_free(child);
+			memmove(node->children + i, node->children + i + 1,
+				(node->n_children - i - 1) * sizeof(struct rope_node *));
+			node->n_children--;
+		} else {
+			node_delete(child, pos, k);
+			i++;
+		}
+		n -= k;
+		pos = 0;
+	}
+
+	/* Keep scattered deletions from leaving a trail of tiny nodes behind. */
+	for (i = 0; i + 1 < node->n_children; ) {
+		if (!node_merge(node, i))
+			i++;
+	}
+	rope_node_update(node);
+}
+
+struct rope *rope_new(void)
+{
+	struct rope *r;
+
+	r = calloc(1, sizeof(struct rope));
+	if (!r)
+		oom();
+	r->root = rope_leaf_new();
+
+	return r;
+}
+
+/* Build a rope from everything that can be read from "fd".
+ * Leaves are filled directly by read() and the tree is built bottom-up.
+ * Return NULL on read errors.
+ */
+struct rope *rope_read(int fd)
+{
+	struct rope_node **nodes = NULL;
+	struct rope *r;
+	int n = 0, alloc = 0;
+
+	for (;;) {
+		struct rope_node *leaf = rope_leaf_new();
+		ssize_t rc = 0;
+
+		while (leaf->bytes < ROPE_LEAF_FILL) {
+			rc = read(fd, leaf->data + leaf->bytes, ROPE_LEAF_FILL - leaf->bytes);
+			if (rc <= 0)
+				break;
+			leaf->bytes += rc;
+		}
+		if (rc < 0) {
+			rope_node_free(leaf);
+			while (n > 0)
+				rope_node_free(nodes[--n]);
+			free(nodes);
+			return NULL;
+		}
+		if (leaf->bytes == 0 && n > 0) {
+			rope_node_free(leaf);
+			break;
+		}
+		leaf->gap_start = leaf->bytes;
+		leaf->newlines = newline_count(leaf->data, leaf->bytes);
+		if (n == alloc) {
+			alloc = max(64, alloc * 2);
+			nodes = realloc(nodes, alloc * sizeof(struct rope_node *));
+			if (!nodes)
+				oom();
+		}
+		nodes[n++] = leaf;
+		if (leaf->bytes < ROPE_LEAF_FILL)
+			break;
+	}
+
+	/* Group every level into parents until a single root is left. */
+	while (n > 1) {
+		int i, parents = 0;
+
+		for (i = 0; i < n; i += ROPE_FANOUT) {
+			struct rope_node *parent = rope_inner_new();
+
+			parent->n_children = min(ROPE_FANOUT, n - i);
+			memcpy(parent->children, nodes + i, parent->n_children * sizeof(struct rope_node *));
+			rope_node_update(parent);
+			nodes[parents++] = parent;
+		}
+		n = parents;
+	}
+
+	r = calloc(1, sizeof(struct rope));
+	if (!r)
+		oom();
+	r->root = nodes[0];
+	free(nodes);
+
+	return r;
+}
+
+void rope_free(struct rope *r)
+{
+	rope_node_free(r->root);
+	free(r);
+}
+
+void rope_clear(struct rope *r)
+{
+	rope_node_free(r->root);
+	r->root = rope_leaf_new();
+	r->cache_leaf = NULL;
+}
+
+/* Find the leaf containing position "pos" and store its position in "start".
+ * Positions at the end of the text belong to the last leaf.
+ */
+static struct rope_node *rope_find(struct rope *r, int pos, int *start)
+{
+	struct rope_node *node = r->root;
+	int p = 0;
+
+	if (r->cache_leaf && pos >= r->cache_pos && pos < r->cache_pos + r->cache_leaf->bytes) {
+		*start = r->cache_pos;
+		return r->cache_leaf;
+	}
+
+	while (!is_leaf(node)) {
+		int i;
+
+		for (i = 0; i < node->n_children - 1; i++) {
+			if (pos < p + node->children[i]->bytes)
+				break;
+			p += node->children[i]->bytes;
+		}
+		node = node->children[i];
+	}
+	r->cache_leaf = node;
+	r->cache_pos = p;
+	*start = p;
+
+	return node;
+}
+
+/* Point "data" at the text stored from position "pos" on.
+ * Return the number of contiguous bytes, 0 at the end of the text.
+ */
+int rope_span(struct rope *r, int pos, const char **data)
+{
+	struct rope_node *leaf;
+	int start, off;
+
+	leaf = rope_find(r, pos, &start);
+	off = pos - start;
+	if (off >= leaf->bytes)
+		return 0;
+	if (off < leaf->gap_start) {
+		*data = leaf->data + off;
+		return leaf->gap_start - off;
+	}
+	*data = leaf->data + leaf->gap_end + (off - leaf->gap_start);
+
+	return leaf->bytes - off;
+}
+
+/* Point "data" at the contiguous text that ends right before position "pos".
+ * Return the number of bytes, 0 at the beginning of the text.
+ */
+int rope_span_before(struct rope *r, int pos, const char **data)
+{
+	struct rope_node *leaf;
+	int start, off;
+
+	if (pos <= 0)
+		return 0;
+	leaf = rope_find(r, pos - 1, &start);
+	off = pos - start;
+	if (off <= leaf->gap_start) {
+		*data = leaf->data;
+		return off;
+	}
+	*data = leaf->data + leaf->gap_end;
+
+	return off - leaf->gap_start;
+}
+
+char rope_byte_at(struct rope *r, int pos)
+{
+	const char *data;
+
+	if (rope_span(r, pos, &data) <= 0)
+		return -1;
+	return *data;
+}
+
+void rope_insert(struct rope *r, int pos, const char *str, int len)
+{
+	r->cache_leaf = NULL;
+
+	/* Insert in chunks that never overflow a freshly split leaf. */
+	while (len > 0) {
+		struct rope_node *split;
+		int n = min(len, ROPE_LEAF_SIZE / 2);
+
+		split = node_insert(r->root, pos, str, n);
+		if (split) {
+			struct rope_node *root = rope_inner_new();
+
+			root->children[0] = r->root;
+			root->children[1] = split;
+			root->n_children = 2;
+			rope_node_update(root);
+			r->root = root;
+		}
+		pos += n;
+		str += n;
+		len -= n;
+	}
+}
+
+void rope_delete(struct rope *r, int pos, int n)
+{
+	r->cache_leaf = NULL;
+	node_delete(r->root, pos, n);
+
+	/* Drop levels that are left with a single child. */
+	while (!is_leaf(r->root) && r->root->n_children <= 1) {
+		struct rope_node *root = r->root;
+
+		if (root->n_children == 0) {
+			r->root = rope_leaf_new();
+		} else {
+			r->root = root->children[0];
+			root->n_children = 0;
+		}
+		rope_node_free(root);
+	}
+}
+
+/* Return the position of the beginning of "line", or -1 if there is no such line. */
+int rope_line_start(struct rope *r, int line)
+{
+	struct rope_node *node = r->root;
+	const char *nl;
+	int p = 0, i;
+
+	if (line == 0)
+		return 0;
+	if (line < 0 || line > node->newlines)
+		return -1;
+
+	/* Look for the "line"-th newline. */
+	while (!is_leaf(node)) {
+		for (i = 0; i < node->n_children - 1; i++) {
+			if (line <= node->children[i]->newlines)
+				break;
+			line -= node->children[i]->newlines;
+			p += node->children[i]->bytes;
+		}
+		node = node->children[i];
+	}
+	nl = newline_find(node->data, node->gap_start, &line);
+	if (nl)
+		return p + (nl - node->data) + 1;
+	nl = newline_find(node->data + node->gap_end, node->bytes - node->gap_start, &line);
+
+	return p + node->gap_start + (nl - (node->data + node->gap_end)) + 1;
+}
+
+/* Return the line containing position "pos". */
+int rope_line_at(struct rope *r, int pos)
+{
+	struct rope_node *node = r->root;
+	int nl = 0, i;
+
+	while (!is_leaf(node)) {
+		for (i = 0; i < node->n_children - 1; i++) {
+			if (pos < node->children[i]->bytes)
+				break;
+			pos -= node->children[i]->bytes;
+			nl += node->children[i]->newlines;
+		}
+		node = node->children[i];
+	}
+
+	return nl + leaf_newlines(node, 0, min(pos, node->bytes));
+}
+
+int rope_length(struct rope *r)
+{
+	return r->root->bytes;
+}
+
+int rope_newlines(struct rope *r)
+{
+	return r->root->newlines;
+}
@@ -0,0 +1,50 @@
+#pragma once
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+#define ROPE_LEAF_SIZE 4096
+/* Leaves built from a file are left partially empty to absorb edits. */
+#define ROPE_LEAF_FILL (ROPE_LEAF_SIZE * 3 / 4)
+#define ROPE_FANOUT 16
+
+/* The rope is a B-tree: all leaves are at the same depth and hold a small gap
+ * buffer each, inner nodes cache the byte and newline counts of their subtree.
+ */
+struct rope_node {
+	int bytes;
+	int newlines;
+	/* Inner nodes only. One extra slot lets a node overflow before it splits. */
+	int n_children;
+	struct rope_node *children[ROPE_FANOUT + 1];
+	/* Leaves only. */
+	char *data;
+	int gap_start;
+	int gap_end;
+};
+
+struct rope {
+	struct rope_node *root;
+	/* Last looked up leaf and its position, makes sequential access cheap. */
+	struct rope_node *cache_leaf;
+	int cache_pos;
+};
+
+struct rope *rope_new(void);
+struct rope *rope_read(int fd);
+void rope_free(struct rope *r);
+void rope_clear(struct rope *r);
+int rope_span(struct rope *r, int pos, const char **data);
+int rope_span_before(struct rope *r, int pos, const char **data);
+char rope_byte_at(struct rope *r, int pos);
+void rope_insert(struct rope *r, int pos, const char *str, int len);
+void rope_delete(struct rope *r, int pos, int n);
+int rope_line_start(struct rope *r, int line);
+int rope_line_at(struct rope *r, int pos);
+int rope_length(struct rope *r);
+int rope_newlines(struct rope *r);
@@ -0,0 +1,397 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+#include "mini.h"
+#include "parallel.h"
+#include "search.h"
+
+/* Searching works on the buffer text in place, one span at a time. Matches
+ * that lie within a span are found there, the few that straddle a span
+ * boundary (the gap, a piece or a rope leaf) are checked byte by byte.
+ * Nothing is copied or allocated.
+ *
+ * Within a span, single bytes are found with memchr(). Short needles are
+ * found by comparing their first and last byte against 16 or 32 positions
+ * at a time and verifying the candidates, which skips over text quickly
+ * unless the needle is very repetitive. Long needles use Boyer-Moore-Horspool
+ * keyed on byte pairs rather than single bytes: in ordinary text most single
+ * bytes occur near the end of a long needle, most pairs don't, so the shifts
+ * stay close to the needle length.
+ */
+
+static inline unsigned char pair_hash(const char *s)
+{
+	return (unsigned char)s[0] * 31 + (unsigned char)s[1];
+}
+
+void search_init(struct search_pattern *pat, const char *str, int len)
+{
+	int i;
+
+	pat->str = str;
+	pat->len = len;
+	if (len <= SEARCH_SHORT_NEEDLE)
+		return;
+
+	/* Shift to the nearest other occurrence of the pair at the end (or the
+	   beginning when searching backward), or by all but one byte. */
+	for (i = 0; i < 256; i++) {
+		pat->skip[i] = len - 1;
+		pat->rskip[i] = len - 1;
+	}
+	for (i = 0; i < len - 2; i++)
+		pat->skip[pair_hash(str + i)] = len - 2 - i;
+	for (i = len - 2; i > 0; i--)
+		pat->rskip[pair_hash(str + i)] = i;
+}
+
+#ifdef SEARCH_X86
+static bool avx2;
+static pthread_once_t avx2_once = PTHREAD_ONCE_INIT;
+
+/* Ask the CPU once: the first searches may run in several threads. */
+static void search_resolve(void)
+{
+	__builtin_cpu_init();
+	avx2 = __builtin_cpu_supports("avx2");
+}
+
+static bool search_avx2(void)
+{
+	pthread_once(&avx2_once, search_resolve);
+	return avx2;
+}
+#endif
+
+/* Check the candidate positions from "i" to "end" one by one. */
+static const char *pair_scan(const char *s, int i, int end, const char *str, int len)
+{
+	for (; i < end; i++) {
+		if (s[i] == str[0] && s[i + len - 1] == str[len - 1] &&
+		    !memcmp(s + i + 1, str + 1, len - 2))
+			return s + i;
+	}
+
+	return NULL;
+}
+
+static const char *pair_rscan(const char *s, int i, int end, const char *str, int len)
+{
+	for (end--; end >= i; end--) {
+		if (s[end] == str[0] && s[end + len - 1] == str[len - 1] &&
+		    !memcmp(s + end + 1, str + 1, len - 2))
+			return s + end;
+	}
+
+	return NULL;
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("avx2")))
+static const char *pair_find_avx2(const char *s, int *pos, int n, const char *str, int len)
+{
+	const __m256i first = _mm256_set1_epi8(str[0]);
+	const __m256i last = _mm256_set1_epi8(str[len - 1]);
+	int i;
+
+	for (i = *pos; i + len - 1 + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + i + len - 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+								      _mm256_cmpeq_epi8(b, last)));
+
+		while (mask) {
+			int k = __builtin_ctz(mask);
+
+			if (!memcmp(s + i + k + 1, str + 1, len - 2))
+				return s + i + k;
+			mask &= mask - 1;
+		}
+	}
+	*pos = i;
+
+	return NULL;
+}
+
+__attribute__((target("avx2")))
+static const char *pair_rfind_avx2(const char *s, int *pos, const char *str, int len)
+{
+	const __m256i first = _mm256_set1_epi8(str[0]);
+	const __m256i last = _mm256_set1_epi8(str[len - 1]);
+	int end;
+
+	for (end = *pos; end >= 32; end -= 32) {
+		int i = end - 32;
+		__m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + i + len - 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+								      _mm256_cmpeq_epi8(b, last)));
+
+		while (mask) {
+			int k = 31 - __builtin_clz(mask);
+
+			if (!memcmp(s + i + k + 1, str + 1, len - 2))
+				return s + i + k;
+			mask &= ~(1u << k);
+		}
+	}
+	*pos = end;
+
+	return NULL;
+}
+#endif
+
+/* Find the first of the "n" - "len" + 1 possible positions of a short needle. */
+static const char *pair_find(const char *s, int n, const char *str, int len)
+{
+	int i = 0;
+#ifdef SEARCH_X86
+	const __m128i first = _mm_set1_epi8(str[0]);
+	const __m128i last = _mm_set1_epi8(str[len - 1]);
+
+	if (search_avx2()) {
+		const char *p = pair_find_avx2(s, &i, n, str, len);
+
+		if (p)
+			return p;
+	}
+	for (; i + len - 1 + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + i + len - 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+								_mm_cmpeq_epi8(b, last)));
+
+		while (mask) {
+			int k = __builtin_ctz(mask);
+
+			if (!memcmp(s + i + k + 1, str + 1, len - 2))
+				return s + i + k;
+			mask &= mask - 1;
+		}
+	}
+#endif
+	return pair_scan(s, i, n - len + 1, str, len);
+}
+
+/* Find the last of the possible positions of a short needle. */
+static const char *pair_rfind(const char *s, int n, const char *str, int len)
+{
+	int end = n - len + 1;
+#ifdef SEARCH_X86
+	const __m128i first = _mm_set1_epi8(str[0]);
+	const __m128i last = _mm_set1_epi8(str[len - 1]);
+
+	if (search_avx2()) {
+		const char *p = pair_rfind_avx2(s, &end, str, len);
+
+		if (p)
+			return p;
+	}
+	for (; end >= 16; end -= 16) {
+		int i = end - 16;
+		__m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + i + len - 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+								_mm_cmpeq_epi8(b, last)));
+
+		while (mask) {
+			int k = 31 - __builtin_clz(mask);
+
+			if (!memcmp(s + i + k + 1, str + 1, len - 2))
+				return s + i + k;
+			mask &= ~(1u << k);
+		}
+	}
+#endif
+	return pair_rscan(s, 0, end, str, len);
+}
+
+static const char *horspool_find(const struct search_pattern *pat, const char *s, int n)
+{
+	const char *str = pat->str;
+	int len = pat->len, i;
+
+	for (i = 0; i <= n - len; ) {
+		const char *w = s + i + len - 2;
+
+		if (w[1] == str[len - 1] && w[0] == str[len - 2] && !memcmp(s + i, str, len - 2))
+			return s + i;
+		i += pat->skip[pair_hash(w)];
+	}
+
+	return NULL;
+}
+
+static const char *horspool_rfind(const struct search_pattern *pat, const char *s, int n)
+{
+	const char *str = pat->str;
+	int len = pat->len, i;
+
+	for (i = n - len; i >= 0; ) {
+		const char *w = s + i;
+
+		if (w[0] == str[0] && w[1] == str[1] && !memcmp(w + 2, str + 2, len - 2))
+			return s + i;
+		i -= pat->rskip[pair_hash(w)];
+	}
+
+	return NULL;
+}
+
+/* Find the first occurrence of the needle within "n" bytes of "s". */
+static const char *search_in(const struct search_pattern *pat, const char *s, int n)
+{
+	if (pat->len > n)
+		return NULL;
+	if (pat->len == 1)
+		return memchr(s, pat->str[0], n);
+	if (pat->len <= SEARCH_SHORT_NEEDLE)
+		return pair_find(s, n, pat->str, pat->len);
+	return horspool_find(pat, s, n);
+}
+
+/* Find the last occurrence of the needle within "n" bytes of "s". */
+static const char *search_in_reverse(const struct search_pattern *pat, const char *s, int n)
+{
+	if (pat->len > n)
+		return NULL;
+	if (pat->len == 1)
+		return memrchr(s, pat->str[0], n);
+	if (pat->len <= SEARCH_SHORT_NEEDLE)
+		return pair_rfind(s, n, pat->str, pat->len);
+	return horspool_rfind(pat, s, n);
+}
+
+/* Return true if "str" is found in the buffer at "pos". */
+static bool search_match_at(struct buffer *buf, int pos, const char *str, int len)
+{
+	struct span sp;
+	int p;
+
+	for (p = pos; buffer_span_forward(buf, p, pos + len, &sp); p += sp.len) {
+		if (memcmp(sp.data, str + (sp.pos - pos), sp.len))
+			return false;
+	}
+
+	return p == pos + len;
+}
+
+/* Find the first occurrence of the pattern that begins at "from" or later
+ * and ends by "end".
+ */
+static int search_until(struct buffer *buf, const struct search_pattern *pat, int from, int end)
+{
+	struct span sp;
+	const char *s;
+	int p, i, len = pat->len;
+
+	if (len == 0)
+		return (from <= end) ? from : -1;
+
+	for (p = max(from, 0); buffer_span_forward(buf, p, end, &sp); p += sp.len) {
+		s = search_in(pat, sp.data, sp.len);
+		if (s)
+			return sp.pos + (s - sp.data);
+		for (i = max(0, sp.len - len + 1); i < sp.len && sp.pos + i + len <= end; i++) {
+			if (sp.data[i] == pat->str[0] && search_match_at(buf, sp.pos + i, pat->str, len))
+				return sp.pos + i;
+		}
+	}
+
+	return -1;
+}
+
+/* Find the first occurrence of the pattern that begins at "from" or later.
+ * Return its position or -1 if there is none.
+ */
+int search_next(struct buffer *buf, const struct search_pattern *pat, int from)
+{
+	return search_until(buf, pat, from, buf->used);
+}
+
+/* Find the first occurrence of the pattern that begins at "from" or later
+ * and ends by "end". Return its position or -1 if there is none.
+ */
+int search_range(struct buffer *buf, const struct search_pattern *pat, int from, int end)
+{
+	return search_until(buf, pat, from, min(end, buf->used));
+}
+
+/* Search a chunk of the text, overlapping the next one by the pattern length. */
+static int search_chunk(struct buffer *buf, int beg, int end, int thread, void *arg,
+			int *match_end)
+{
+	const struct search_pattern *pat = arg;
+	int p;
+
+	p = search_until(buf, pat, beg, min(end + pat->len - 1, buf->used));
+	*match_end = p + pat->len;
+
+	return p;
+}
+
+/* Like search_next(), but a large buffer is searched with several threads. */
+int search_next_parallel(struct buffer *buf, const struct search_pattern *pat, int from)
+{
+	int end;
+
+	from = max(from, 0);
+	return parallel_search(buf, from, parallel_threads(buf, from), search_chunk, (void *)pat, &end);
+}
+
+/* Find the last occurrence of the pattern that begins before "from".
+ * Return its position or -1 if there is none.
+ */
+int search_prev(struct buffer *buf, const struct search_pattern *pat, int from)
+{
+	struct span sp;
+	const char *s;
+	int p, i, len = pat->len;
+
+	if (len == 0)
+		return (from > 0) ? min(from, buf->used) - 1 : -1;
+
+	for (p = from; buffer_span_backward(buf, p, 0, &sp); p -= sp.len) {
+		for (i = sp.len - 1; i >= max(0, sp.len - len + 1); i--) {
+			if (sp.data[i] == pat->str[0] && search_match_at(buf, sp.pos + i, pat->str, len))
+				return sp.pos + i;
+		}
+		s = search_in_reverse(pat, sp.data, sp.len);
+		if (s)
+			return sp.pos + (s - sp.data);
+	}
+
+	return -1;
+}
+
+int search_forward(struct buffer *buf, int from, const char *str, int len)
+{
+	struct search_pattern pat;
+
+	search_init(&pat, str, len);
+	return search_next_parallel(buf, &pat, from);
+}
+
+int search_backward(struct buffer *buf, int from, const char *str, int len)
+{
+	struct search_pattern pat;
+
+	search_init(&pat, str, len);
+	return search_prev(buf, &pat, from);
+}
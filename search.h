@@ -0,0 +1,35 @@
+#pragma once
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Needles up to this long are found by filtering on their first and last
+ * byte, longer ones by Boyer-Moore-Horspool.
+ */
+#define SEARCH_SHORT_NEEDLE 64
+
+struct buffer;
+
+/* A needle prepared for searching, so that repeated searches (going to the
+ * next match, replacing all) don't have to rebuild the skip tables.
+ */
+struct search_pattern {
+	const char *str;
+	int len;
+	/* Horspool shifts by byte pair, for searching forward and backward. */
+	int skip[256];
+	int rskip[256];
+};
+
+void search_init(struct search_pattern *pat, const char *str, int len);
+int search_next(struct buffer *buf, const struct search_pattern *pat, int from);
+int search_range(struct buffer *buf, const struct search_pattern *pat, int from, int end);
+int search_next_parallel(struct buffer *buf, const struct search_pattern *pat, int from);
+int search_prev(struct buffer *buf, const struct search_pattern *pat, int from);
+int search_forward(struct buffer *buf, int from, const char *str, int len);
+int search_backward(struct buffer *buf, int from, const char *str, int len);
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+/* Check that searching with several threads finds what one thread finds.
+ *
+ * Every search is forced onto TEST_THREADS threads and TEST_CHUNK byte
+ * chunks, so that small random texts in each storage are split into many
+ * chunks, matches straddle them and later chunks get cancelled. Build with
+ * -fsanitize=thread to look for races, or address,undefined.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mini.h"
+#include "../parallel.h"
+#include "../piece.h"
+#include "../regex.h"
+#include "../rope.h"
+#include "../search.h"
+
+#define TEST_THREADS 4
+#define TEST_CHUNK 7
+#define TEST_BUFFERS 300
+#define TEST_MAX_LEN 3000
+#define TEST_NEEDLES 20
+
+static const char *patterns[] = {
+	"a", "ab+a", "a.*b", "^b", "a$", "(ab|ba)a", "b[^a]*b", "abba.*a", "c", "b\\n*c",
+	"[ac]{3}", "^$", "a*", "x",
+};
+
+static int failures;
+
+/* Move the empty buffer to "storage". */
+static void set_storage(struct buffer *buf, enum storage storage)
+{
+	if (storage == STORAGE_GAP)
+		return;
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+	buf->gap_start = 0;
+	buf->gap_end = 0;
+	if (storage == STORAGE_PIECE)
+		buf->pieces = piece_table_new();
+	else
+		buf->rope = rope_new();
+	buf->storage = storage;
+}
+
+/* Fill a buffer with "len" bytes of random text, inserted out of order in
+   small pieces, and keep a copy in "text". */
+static struct buffer *make_buffer(enum storage storage, char *text, int len)
+{
+	struct buffer *buf = buffer_new();
+	int n = 0;
+
+	buf->undo.max = 0;
+	set_storage(buf, storage);
+	while (n < len) {
+		int pos = n ? rand() % (n + 1) : 0;
+		int k = min(1 + rand() % 40, len - n), i;
+		char s[40];
+
+		for (i = 0; i < k; i++)
+			s[i] = "aaabbb\nc"[rand() % 8];
+		buffer_set_cursor(buf, pos);
+		buffer_insert_string(buf, s, k);
+		memmove(text + pos + k, text + pos, n - pos);
+		memcpy(text + pos, s, k);
+		n += k;
+	}
+
+	return buf;
+}
+
+static int naive_search(const char *text, int len, int from, const char *needle, int n)
+{
+	int p;
+
+	for (p = from; p + n <= len; p++) {
+		if (memcmp(text + p, needle, n) == 0)
+			return p;
+	}
+
+	return -1;
+}
+
+static void check_literals(struct buffer *buf, const char *text, int len, const char *name)
+{
+	char needle[5];
+	int i, j, n, from, want, got;
+
+	for (i = 0; i < TEST_NEEDLES; i++) {
+		n = 1 + rand() % 4;
+		for (j = 0; j < n; j++)
+			needle[j] = "ab\nc"[rand() % 4];
+		from = rand() % (len + 1);
+		want = naive_search(text, len, from, needle, n);
+		got = search_forward(buf, from, needle, n);
+		if (got != want) {
+			printf("%s: literal \"%.*s\" from %d of %d: %d, expected %d\n",
+			       name, n, needle, from, len, got, want);
+			failures++;
+		}
+	}
+}
+
+static void check_regexes(struct buffer *buf, int len, const char *name)
+{
+	const char *error;
+	struct regex *re;
+	int i, from, want, got, want_end, got_end;
+
+	for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+		re = regex_compile(patterns[i], strlen(patterns[i]), &error);
+		if (!re) {
+			printf("%s: %s\n", patterns[i], error);
+			failures++;
+			continue;
+		}
+		from = rand() % (len + 1);
+		want_end = got_end = -1;
+		/* A range search never takes the parallel path. */
+		want = regex_search_range(re, buf, from, len + 1, &want_end);
+		got = regex_search_forward(re, buf, from, &got_end);
+		if (got != want || got >= 0 && got_end != want_end) {
+			printf("%s: regex /%s/ from %d of %d: %d-%d, expected %d-%d\n",
+			       name, patterns[i], from, len, got, got_end, want, want_end);
+			failures++;
+		}
+		regex_free(re);
+	}
+}
+
+int main(void)
+{
+	static const char *names[] = {"gap", "piece", "rope"};
+	static char text[TEST_MAX_LEN];
+	struct buffer *buf;
+	char *content;
+	int i, s, len;
+
+	parallel_force(TEST_THREADS, TEST_CHUNK);
+	srand(1);
+	for (i = 0; i < TEST_BUFFERS; i++) {
+		for (s = STORAGE_GAP; s <= STORAGE_ROPE; s++) {
+			len = rand() % TEST_MAX_LEN;
+			buf = make_buffer(s, text, len);
+			content = buffer_get_content(buf);
+			if (buf->used != len || memcmp(content, text, len)) {
+				printf("%s: the buffer doesn't hold the text\n", names[s]);
+				return 1;
+			}
+			free(content);
+			check_literals(buf, text, len, names[s]);
+			check_regexes(buf, len, names[s]);
+			buffer_free(buf);
+		}
+	}
+	if (failures) {
+		printf("parallel_test: %d failures\n", failures);
+		return 1;
+	}
+	printf("parallel_test: %d buffers in each storage, all searches agree\n", TEST_BUFFERS);
+
+	return 0;
+}
@@ -0,0 +1,333 @@
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mini.h"
+#include "color.h"
+#include "utf8.h"
+#include "vt.h"
+
+#define CSI "\033["
+
+/* One character on the screen. An attribute of -1 never matches, so the
+ * cell is sent to the terminal whatever it holds.
+ */
+struct cell {
+	char ch[4];
+	int len;
+	int attr;
+};
+
+static struct {
+	const struct color *colors;
+	const struct color_pair *color_pairs;
+	int fg;
+	int bg;
+	int rows;
+	int cols;
+	/* What the terminal shows and what it is going to show. */
+	struct cell *front;
+	struct cell *back;
+	/* Where drawing goes, and where the cursor is left. */
+	int y;
+	int x;
+	int cursor_y;
+	int cursor_x;
+	/* Where the terminal's cursor is and what it draws with, -1 if unknown. */
+	int term_y;
+	int term_x;
+	int term_attr;
+	bool in_frame;
+	char *out;
+	size_t out_len;
+	size_t out_size;
+} vt;
+
+static const struct cell blank = {{' '}, 1, 0};
+
+static void out_bytes(const char *s, size_t n)
+{
+	if (vt.out_len + n > vt.out_size) {
+		vt.out_size = max(vt.out_len + n, vt.out_size * 2);
+		vt.out = realloc(vt.out, vt.out_size);
+		if (!vt.out)
+			oom();
+	}
+	memcpy(vt.out + vt.out_len, s, n);
+	vt.out_len += n;
+}
+
+static void out_printf(const char *fmt, ...)
+{
+	char s[64];
+	va_list va;
+	int n;
+
+	va_start(va, fmt);
+	n = vsnprintf(s, sizeof(s), fmt, va);
+	va_end(va);
+	out_bytes(s, min(n, sizeof(s) - 1));
+}
+
+/* Everything sent from here to vt_flush() is shown at once. */
+static void frame_begin(void)
+{
+	if (vt.in_frame)
+		return;
+	out_printf(CSI "?2026h");
+	vt.in_frame = true;
+}
+
+static void out_color(const char *sgr, int id, int dflt)
+{
+	int i;
+
+	if (id < 0)
+		id = dflt;
+	for (i = 0; vt.colors[i].id >= 0; i++) {
+		if (vt.colors[i].id == id) {
+			out_printf(";%s;2;%d;%d;%d", sgr, vt.colors[i].r, vt.colors[i].g, vt.colors[i].b);
+			return;
+		}
+	}
+}
+
+static void out_attr(int attr)
+{
+	int fg = -1, bg = -1, i;
+
+	if (attr == vt.term_attr)
+		return;
+	for (i = 0; vt.color_pairs[i].id >= 0; i++) {
+		if (vt.color_pairs[i].id == ATTR_PAIR(attr)) {
+			fg = vt.color_pairs[i].fg;
+			bg = vt.color_pairs[i].bg;
+			break;
+		}
+	}
+	out_printf(CSI "0");
+	if (attr & ATTR_BOLD)
+		out_printf(";1");
+	out_color("38", fg, vt.fg);
+	out_color("48", bg, vt.bg);
+	out_printf("m");
+	vt.term_attr = attr;
+}
+
+static void out_move(int y, int x)
+{
+	if (y == vt.term_y && x == vt.term_x)
+		return;
+	if (y == vt.term_y && x == 0)
+		out_printf("\r");
+	else if (y == vt.term_y && x > vt.term_x && vt.term_x >= 0)
+		out_printf(CSI "%dC", x - vt.term_x);
+	else
+		out_printf(CSI "%d;%dH", y + 1, x + 1);
+	vt.term_y = y;
+	vt.term_x = x;
+}
+
+void vt_init(const struct color *colors, const struct color_pair *color_pairs, int fg, int bg)
+{
+	vt.colors = colors;
+	vt.color_pairs = color_pairs;
+	vt.fg = fg;
+	vt.bg = bg;
+}
+
+void vt_end(void)
+{
+	out_printf(CSI "0m");
+	vt.term_attr = -1;
+	vt_flush();
+}
+
+/* Make the grids "rows" by "cols" cells, and draw all of it on the next flush. */
+void vt_resize(int rows, int cols)
+{
+	int i;
+
+	if (rows == vt.rows && cols == vt.cols)
+		return;
+	vt.front = realloc(vt.front, rows * cols * sizeof(struct cell));
+	vt.back = realloc(vt.back, rows * cols * sizeof(struct cell));
+	if (!vt.front || !vt.back)
+		oom();
+	for (i = 0; i < rows * cols; i++)
+		vt.back[i] = blank;
+	vt.rows = rows;
+	vt.cols = cols;
+	vt_invalidate();
+}
+
+/* Forget what the terminal shows, after something else drew on it. */
+void vt_invalidate(void)
+{
+	int i;
+
+	for (i = 0; i < vt.rows * vt.cols; i++)
+		vt.front[i].attr = -1;
+	vt.term_y = -1;
+	vt.term_x = -1;
+	vt.term_attr = -1;
+}
+
+void vt_move(int y, int x)
+{
+	vt.y = y;
+	vt.x = x;
+}
+
+/* Draw "n" bytes of "s" from where vt_move() left off, up to the end of the row.
+ * Tabs are expanded and control characters shown as "?".
+ */
+void vt_addnstr(const char *s, int n, int attr)
+{
+	struct cell *row;
+	int i;
+
+	if (vt.y < 0 || vt.y >= vt.rows)
+		return;
+	row = vt.back + vt.y * vt.cols;
+	for (i = 0; i < n; i++) {
+		unsigned char c = s[i];
+
+		if (!is_utf8(c)) {
+			/* Continues the character in the previous cell. */
+			if (vt.x > 0 && vt.x <= vt.cols && row[vt.x - 1].len < 4)
+				row[vt.x - 1].ch[row[vt.x - 1].len++] = c;
+			continue;
+		}
+		if (c == '\t') {
+			do {
+				if (vt.x < vt.cols)
+					row[vt.x] = (struct cell){{' '}, 1, attr};
+				vt.x++;
+			} while (vt.x % TAB_STOP);
+			continue;
+		}
+		if (vt.x >= vt.cols)
+			continue;
+		row[vt.x] = (struct cell){{(c < ' ' || c == 0x7f) ? '?' : c}, 1, attr};
+		vt.x++;
+	}
+}
+
+void vt_clrtoeol(void)
+{
+	int x;
+
+	if (vt.y < 0 || vt.y >= vt.rows)
+		return;
+	for (x = vt.x; x < vt.cols; x++)
+		vt.back[vt.y * vt.cols + x] = blank;
+}
+
+/* Scroll rows "top" to "bottom" by "n", up if positive. The terminal does it
+ * with a scroll region, so the rows moved don't have to be sent again.
+ */
+void vt_scroll(int top, int bottom, int n)
+{
+	int height = bottom - top + 1, keep = height - abs(n), dst, src, i;
+	struct cell *grids[] = {vt.front, vt.back};
+
+	if (n == 0 || keep <= 0 || top < 0 || bottom >= vt.rows)
+		return;
+
+	frame_begin();
+	out_attr(0);
+	out_printf(CSI "%d;%dr" CSI "%d%c" CSI "r", top + 1, bottom + 1, abs(n), (n > 0) ? 'S' : 'T');
+	/* Resetting the scroll region homes the cursor. */
+	vt.term_y = 0;
+	vt.term_x = 0;
+
+	dst = (n > 0) ? top : top - n;
+	src = (n > 0) ? top + n : top;
+	for (i = 0; i < 2; i++) {
+		memmove(grids[i] + dst * vt.cols, grids[i] + src * vt.cols,
+			keep * vt.cols * sizeof(struct cell));
+	}
+	/* Whatever the terminal filled the new rows with is drawn over. */
+	dst = (n > 0) ? top + keep : top;
+	for (i = 0; i < abs(n) * vt.cols; i++) {
+		vt.front[dst * vt.cols + i].attr = -1;
+		vt.back[dst * vt.cols + i] = blank;
+	}
+}
+
+void vt_cursor(int y, int x)
+{
+	vt.cursor_y = y;
+	vt.cursor_x = x;
+}
+
+static bool cell_equal(const struct cell *a, const struct cell *b)
+{
+	return a->attr == b->attr && a->len == b->len && !memcmp(a->ch, b->ch, a->len);
+}
+
+/* Send the cells that changed and leave the cursor where vt_cursor() put it. */
+void vt_flush(void)
+{
+	int y, x, first, last, clear;
+	size_t done;
+	ssize_t n;
+
+	for (y = 0; y < vt.rows; y++) {
+		struct cell *front = vt.front + y * vt.cols;
+		struct cell *back = vt.back + y * vt.cols;
+
+		for (first = 0; first < vt.cols && cell_equal(&front[first], &back[first]); first++)
+			;
+		if (first == vt.cols)
+			continue;
+		for (last = vt.cols - 1; cell_equal(&front[last], &back[last]); last--)
+			;
+		/* Blanks up to the end of the row are cleared rather than sent. */
+		for (clear = vt.cols; clear > first && cell_equal(&back[clear - 1], &blank); clear--)
+			;
+
+		frame_begin();
+		out_move(y, first);
+		for (x = first; x < clear && x <= last; x++) {
+			out_attr(back[x].attr);
+			out_bytes(back[x].ch, back[x].len);
+			front[x] = back[x];
+		}
+		vt.term_x = (x < vt.cols) ? x : -1;
+		if (clear <= last) {
+			out_attr(0);
+			out_printf(CSI "K");
+			for (x = clear; x < vt.cols; x++)
+				front[x] = blank;
+		}
+	}
+
+	if (vt.in_frame || vt.cursor_y != vt.term_y || vt.cursor_x != vt.term_x) {
+		frame_begin();
+		out_move(vt.cursor_y, vt.cursor_x);
+		out_printf(CSI "?2026l");
+	}
+	for (done = 0; done < vt.out_len; done += n) {
+		n = write(STDOUT_FILENO, vt.out + done, vt.out_len - done);
+		if (n < 0 && errno != EINTR)
+			break;
+		n = max(n, 0);
+	}
+	vt.out_len = 0;
+	vt.in_frame = false;
+}
@@ -0,0 +1,32 @@
+#pragma once
+/*
+ * Copyright 2015 Jan Synáček
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or
+ * (at your option) any later version.
+ */
+
+#include <stdbool.h>
+
+/* Output straight to a VT100-like terminal, bypassing curses.
+ * Text is drawn into a grid of cells. vt_flush() compares it to the grid on
+ * the terminal and sends only the cells that differ, as one write() wrapped
+ * in a synchronized update, so that a frame never shows half drawn.
+ * Attributes are color pairs as in color.h, possibly with ATTR_BOLD.
+ */
+
+struct color;
+struct color_pair;
+
+void vt_init(const struct color *colors, const struct color_pair *color_pairs, int fg, int bg);
+void vt_end(void);
+void vt_resize(int rows, int cols);
+void vt_invalidate(void);
+void vt_move(int y, int x);
+void vt_addnstr(const char *s, int n, int attr);
+void vt_clrtoeol(void);
+void vt_scroll(int top, int bottom, int n);
+void vt_cursor(int y, int x);
+void vt_flush(void);